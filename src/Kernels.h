@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <type_traits>
+
+#include "Precision.h"
+
+/**
+ * smoothing kernels of the solver, picked with SPH_KERNEL and SPH_KERNEL_TABLE in CMake
+ * a kernel is a policy of static functions. For(h) gives its coefficients for the support radius h,
+ * Density(c, r2) evaluates W, Gradient(c, r) dW/dr and Laplacian(c, r) the Laplacian of the
+ * viscosity term, all for 0 <= r < h. The analytic kernels take Real or SimdVector<Real>, so the
+ * per-particle, batch and cluster loops are all specialized on the same kernel
+ */
+
+// scalar counterparts of the SimdVector functions, so a kernel reads the same for both
+template<typename T>
+    requires std::is_floating_point_v<T>
+constexpr T Blend(bool mask, T a, T b)
+{
+    return mask ? a : b;
+}
+
+template<typename T>
+    requires std::is_floating_point_v<T>
+constexpr T Sqrt(T x)
+{
+    if (std::is_constant_evaluated())
+    {
+        // Newton's method for the tables, std::sqrt is not constexpr
+        T root = x > 1 ? x : T(1);
+        for (int k = 0; k < 64 && x > 0; ++k)
+        {
+            root = (root + x / root) / 2;
+        }
+        return x > 0 ? root : T(0);
+    }
+    return std::sqrt(x);
+}
+
+// scalar in every lane of V
+template<typename V>
+constexpr V Splat(Real scalar)
+{
+    if constexpr (std::is_floating_point_v<V>)
+    {
+        return scalar;
+    }
+    else
+    {
+        return V::Broadcast(scalar);
+    }
+}
+
+template<int N>
+constexpr Real Pow(Real x)
+{
+    Real result = 1;
+    for (int k = 0; k < N; ++k)
+    {
+        result *= x;
+    }
+    return result;
+}
+
+inline constexpr Real KERNEL_PI = std::numbers::pi_v<Real>;
+
+// Müller et al. 2003: Poly6 for density, the Spiky gradient for pressure and the viscosity kernel
+// Laplacian for viscosity. The gradient keeps the (h - r)^3 form the solver was tuned with
+struct MullerKernel
+{
+    static constexpr const char* NAME = "muller";
+    static constexpr bool TABULATED   = false;
+    using Analytic                    = MullerKernel;
+
+    struct Coefficients
+    {
+        Real h, hsq;
+        Real density, gradient, laplacian;
+    };
+
+    static constexpr Coefficients For(Real h)
+    {
+        return {h,
+                h * h,
+                4 / (KERNEL_PI * Pow<8>(h)),
+                -10 / (KERNEL_PI * Pow<5>(h)),
+                40 / (KERNEL_PI * Pow<5>(h))};
+    }
+
+    template<typename V>
+    static constexpr V Density(const Coefficients& c, V r2)
+    {
+        V w = Splat<V>(c.hsq) - r2;
+        return Splat<V>(c.density) * w * w * w;
+    }
+
+    template<typename V>
+    static constexpr V Gradient(const Coefficients& c, V r)
+    {
+        V w = Splat<V>(c.h) - r;
+        return Splat<V>(c.gradient) * w * w * w;
+    }
+
+    template<typename V>
+    static constexpr V Laplacian(const Coefficients& c, V r)
+    {
+        return Splat<V>(c.laplacian) * (Splat<V>(c.h) - r);
+    }
+};
+
+// M4 cubic B-spline, with the support h at twice the smoothing length. The Laplacian is the
+// -2 / r dW/dr form of Brookshaw 1985, as are the ones of the other compact kernels
+struct CubicSplineKernel
+{
+    static constexpr const char* NAME = "cubic";
+    static constexpr bool TABULATED   = false;
+    using Analytic                    = CubicSplineKernel;
+
+    struct Coefficients
+    {
+        Real h, hsq, invH;
+        Real density, gradient, laplacian;
+    };
+
+    static constexpr Coefficients For(Real h)
+    {
+        Real sigma = 40 / (7 * KERNEL_PI * h * h);
+        return {h, h * h, 1 / h, sigma, sigma / h, 2 * sigma / (h * h)};
+    }
+
+    template<typename V>
+    static constexpr V Density(const Coefficients& c, V r2)
+    {
+        V q     = Sqrt(r2) * Splat<V>(c.invH);
+        V u     = Splat<V>(1) - q;
+        V inner = Splat<V>(1) - Splat<V>(6) * q * q * (Splat<V>(1) - q);
+        V outer = Splat<V>(2) * u * u * u;
+        return Splat<V>(c.density) * Blend(q < Splat<V>(0.5f), inner, outer);
+    }
+
+    template<typename V>
+    static constexpr V Gradient(const Coefficients& c, V r)
+    {
+        V q     = r * Splat<V>(c.invH);
+        V u     = Splat<V>(1) - q;
+        V inner = q * (Splat<V>(18) * q - Splat<V>(12));
+        V outer = Splat<V>(-6) * u * u;
+        return Splat<V>(c.gradient) * Blend(q < Splat<V>(0.5f), inner, outer);
+    }
+
+    template<typename V>
+    static constexpr V Laplacian(const Coefficients& c, V r)
+    {
+        // the outer piece divides by q, clamped so the lanes of the inner piece stay finite
+        V q        = r * Splat<V>(c.invH);
+        V u        = Splat<V>(1) - q;
+        auto inner = q < Splat<V>(0.5f);
+        V outer    = Splat<V>(6) * u * u / Blend(inner, Splat<V>(0.5f), q);
+        return Splat<V>(c.laplacian) * Blend(inner, Splat<V>(12) - Splat<V>(18) * q, outer);
+    }
+};
+
+// Wendland C2, positive in Fourier space so it does not pair up particles, and stays smooth with
+// many neighbors per support. Its gradient vanishes at r = 0
+struct WendlandKernel
+{
+    static constexpr const char* NAME = "wendland";
+    static constexpr bool TABULATED   = false;
+    using Analytic                    = WendlandKernel;
+
+    struct Coefficients
+    {
+        Real h, hsq, invH;
+        Real density, gradient, laplacian;
+    };
+
+    static constexpr Coefficients For(Real h)
+    {
+        Real sigma = 7 / (KERNEL_PI * h * h);
+        return {h, h * h, 1 / h, sigma, -20 * sigma / h, 40 * sigma / (h * h)};
+    }
+
+    template<typename V>
+    static constexpr V Density(const Coefficients& c, V r2)
+    {
+        V q  = Sqrt(r2) * Splat<V>(c.invH);
+        V u  = Splat<V>(1) - q;
+        V u2 = u * u;
+        return Splat<V>(c.density) * u2 * u2 * (Splat<V>(1) + Splat<V>(4) * q);
+    }
+
+    template<typename V>
+    static constexpr V Gradient(const Coefficients& c, V r)
+    {
+        V q = r * Splat<V>(c.invH);
+        V u = Splat<V>(1) - q;
+        return Splat<V>(c.gradient) * q * u * u * u;
+    }
+
+    template<typename V>
+    static constexpr V Laplacian(const Coefficients& c, V r)
+    {
+        V u = Splat<V>(1) - r * Splat<V>(c.invH);
+        return Splat<V>(c.laplacian) * u * u * u;
+    }
+};
+
+// Base sampled at SIZE even steps of r^2 and interpolated linearly, which saves the square root
+// and the polynomial of the kernels that need r. The tables are filled for one support radius,
+// and lookups do not vectorize, so varying h and the SIMD loops evaluate Analytic instead
+template<typename Base, uint32_t SIZE = 1024>
+struct TabulatedKernel
+{
+    static constexpr const char* NAME = Base::NAME;
+    static constexpr bool TABULATED   = true;
+    using Analytic                    = Base;
+    using Table                       = std::array<Real, SIZE + 1>;
+
+    struct Coefficients : Base::Coefficients
+    {
+        Real scale;  // table steps per unit of r^2
+        Table densityTable, gradientTable, laplacianTable;
+    };
+
+    static constexpr Coefficients For(Real h)
+    {
+        Coefficients c{Base::For(h)};
+        c.scale = SIZE / (h * h);
+        for (uint32_t k = 0; k <= SIZE; ++k)
+        {
+            Real r2             = k / c.scale;
+            c.densityTable[k]   = Base::Density(c, r2);
+            c.gradientTable[k]  = Base::Gradient(c, Sqrt(r2));
+            c.laplacianTable[k] = Base::Laplacian(c, Sqrt(r2));
+        }
+        return c;
+    }
+
+    static Real Density(const Coefficients& c, Real r2)
+    {
+        return Lookup(c, c.densityTable, r2);
+    }
+
+    static Real Gradient(const Coefficients& c, Real r)
+    {
+        return Lookup(c, c.gradientTable, r * r);
+    }
+
+    static Real Laplacian(const Coefficients& c, Real r)
+    {
+        return Lookup(c, c.laplacianTable, r * r);
+    }
+
+private:
+    static Real Lookup(const Coefficients& c, const Table& table, Real r2)
+    {
+        // r < h can still round to r^2 = h^2, so the last step is clamped
+        Real x     = r2 * c.scale;
+        uint32_t k = std::min((uint32_t)x, SIZE - 1);
+        Real f     = x - k;
+        return table[k] + f * (table[k + 1] - table[k]);
+    }
+};
+
+#if defined(SPH_KERNEL_CUBIC)
+using AnalyticKernel = CubicSplineKernel;
+#elif defined(SPH_KERNEL_WENDLAND)
+using AnalyticKernel = WendlandKernel;
+#else
+using AnalyticKernel = MullerKernel;
+#endif
+
+#if defined(SPH_KERNEL_TABLE)
+using Kernel = TabulatedKernel<AnalyticKernel>;
+#else
+using Kernel = AnalyticKernel;
+#endif
@@ -1,5 +1,3 @@
-#define _USE_MATH_DEFINES
-
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
 
@@ -7,71 +5,270 @@
 using namespace Eigen;
 
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
 #include <cmath>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+
+#include "Kernels.h"
+#include "ParallelBackend.h"
+#include "ParticleStore.h"
+#include "Precision.h"
+#include "Simd.h"
 
 #ifdef __EMSCRIPTEN__
     #include <emscripten.h>
     #include <emscripten/html5.h>
 #endif
 
-static constexpr int WINDOW_WIDTH   = 800;
-static constexpr int WINDOW_HEIGHT  = 600;
-static constexpr double VIEW_WIDTH  = 1.0 * 800.0f;
-static constexpr double VIEW_HEIGHT = 1.0 * 600.0f;
+static constexpr int WINDOW_WIDTH  = 800;
+static constexpr int WINDOW_HEIGHT = 600;
+static constexpr Real VIEW_WIDTH   = 1.0 * 800.0f;
+static constexpr Real VIEW_HEIGHT  = 1.0 * 600.0f;
 
-SDL_Window* window     = nullptr;
-SDL_Renderer* renderer = nullptr;
-bool isRunning         = true;
+SDL_Window* window          = nullptr;
+SDL_Renderer* renderer      = nullptr;
+std::atomic<bool> isRunning = true;  // also read by the solver thread of --async-render
 
 // solver parameters
-static const Vector2d G(0.0f, 10.0f);        // external (gravitational) forces
-static constexpr float REST_DENS = 300.0f;   // rest density
-static constexpr float GAS_CONST = 2000.0f;  // const for equation of state
-static constexpr float H         = 16.0f;    // kernel radius
-static constexpr float HSQ       = H * H;    // radius^2 for optimization
-static constexpr float MASS      = 2.5f;     // assume all particles have the same mass
-static constexpr float VISC      = 200.0f;   // viscosity constant
-static constexpr float DT        = 0.0007f;  // integration timestep
-
-// smoothing kernels defined in Müller and their gradients
-const static float POLY6      = 4.f / (M_PI * std::pow(H, 8.f));
-const static float SPIKY_GRAD = -10.f / (M_PI * std::pow(H, 5.f));
-const static float VISC_LAP   = 40.f / (M_PI * std::pow(H, 5.f));
+static const Vector2r G(0.0f, 10.0f);       // external (gravitational) forces
+static constexpr Real REST_DENS = 300.0f;   // rest density
+static constexpr Real GAS_CONST = 2000.0f;  // const for equation of state
+static constexpr Real H         = 16.0f;    // kernel radius
+static constexpr Real HSQ       = H * H;    // radius^2 for optimization
+static constexpr Real MASS      = 2.5f;     // assume all particles have the same mass
+static constexpr Real VISC      = 200.0f;   // viscosity constant
+static constexpr Real DT        = 0.0007f;  // integration timestep
+
+// smoothing kernel picked in Kernels.h, its coefficients for H are evaluated at compile time
+static constexpr Kernel::Coefficients KERNEL = Kernel::For(H);
 
 // simulation parameters
-static constexpr float EPS           = H;  // boundary epsilon
-static constexpr float BOUND_DAMPING = -0.5f;
-
-/**
- * particle data structure
- * stores position, velocity, and force for integration
- * stores density(rho) and pressure values for SPH
- */
-struct Particle
-{
-    Particle(float x, float y) :
-        position(x, y), velocity(0.0f, 0.0f), force(0.0f, 0.0f), density(0.0f), pressure(0.0f) {};
-
-    Vector2d position;
-    Vector2d velocity;
-    Vector2d force;
-    float density;
-    float pressure;
+static constexpr Real EPS           = H;  // boundary epsilon
+static constexpr Real BOUND_DAMPING = -0.5f;
+
+// runtime options, set from the command line
+enum class GridType
+{
+    Dense,  // one cell per H x H square of the view
+    Hash,   // only occupied cells, found through a hash table
+};
+
+enum class Schedule
+{
+    Static,   // one contiguous slice of particles per thread
+    Dynamic,  // threads claim chunks of particles until none are left
 };
 
+struct Options
+{
+    GridType grid              = GridType::Dense;
+    uint32_t cellDivisions     = 1;      // cells per H along each axis
+    uint32_t reorderInterval   = 0;      // steps between spatial reorders of particles, 0 disables
+    float verletSkin           = 0.0f;   // extra radius of cached neighbor lists, 0 disables them
+    bool symmetric             = false;  // evaluate each pair once and apply it to both particles
+    bool pairCache             = false;  // record the pairs of the density pass for the force pass
+    uint32_t adaptiveNeighbors = 0;      // neighbor count that per-particle h aims for, 0 keeps H
+    Schedule schedule          = Schedule::Dynamic;
+    uint32_t grain             = 32;     // particles per chunk of the dynamic schedule
+    bool fused                 = false;  // run a whole step in one parallel region with barriers
+    bool pinThreads            = false;  // bind each pool thread to its own cpu
+    bool firstTouch            = false;  // owning threads write particle and grid memory first
+    uint32_t threads           = 0;      // threads for every phase, 0 picks them per phase
+    bool asyncRender           = false;  // simulate on a thread of its own while main draws
+    bool cellOrder             = false;  // walk the plain passes cell by cell over gathered blocks
+    bool simd                  = false;  // evaluate the neighbors of a particle a vector at a time
+    uint32_t clusterSize       = 0;      // particles per cluster of the cluster passes, 0 disables
+    bool profile               = false;  // time each thread of the parallel particle loops
+    std::string profileCsv;              // file for the per-step profile, empty writes none
+};
+static Options options;
+
 // solver data
-static std::vector<Particle> particles;
+static ParticleStore particles;
+static ParticleStore sortedParticles;        // scratch storage for ReorderParticles
+static std::vector<uint32_t> particleIndex;  // current index of each particle id
+static uint64_t stepCount       = 0;
+static uint64_t nextReorderStep = 0;
 
 // Cells
-static const uint32_t CELL_NX = (uint32_t)std::ceil(VIEW_WIDTH / H);
-static const uint32_t CELL_NY = (uint32_t)std::ceil(VIEW_HEIGHT / H);
-static std::vector<std::vector<uint32_t>> cells;
+static Real CELL_SIZE        = H;  // H / cellDivisions
+static uint32_t CELL_NX      = 0;
+static uint32_t CELL_NY      = 0;
+static uint32_t NUM_CELLS    = 0;  // cell ids follow the Morton curve, so this exceeds NX * NY
+static uint32_t numGridCells = 0;  // cells in the current grid, NUM_CELLS or the occupied cells
+static std::vector<Vector2i> neighborStencil;  // cell offsets that can hold a particle within H
+static std::vector<Vector2i> halfStencil;      // forward half of neighborStencil
+static std::vector<Vector2i> verletStencil;    // cell offsets within H + skin
+static AlignedVector<uint32_t> cellStart;      // first entry of each cell, plus end sentinel
+static uint32_t cellThreads = 1;               // threads of the current grid build
+static AlignedVector<uint32_t> cellCounts;     // per-thread cell histograms, then scatter cursors
+static std::vector<uint32_t> cellBlockSums;    // particles in each thread's block of cells
+static AlignedVector<uint32_t> cellEntries;    // particle indices grouped by cell
+static AlignedVector<uint32_t> particleCells;  // cell id of each particle
+
+// sparse grid, numbers the occupied cells through an open addressing hash table
+static constexpr uint64_t EMPTY_KEY = ~0ull;
+static constexpr uint32_t NOT_FOUND = ~0u;
+static std::vector<uint64_t> hashKeys;      // cell key of each slot, EMPTY_KEY if unused
+static std::vector<uint32_t> hashCells;     // cell id of each slot
+static std::vector<uint64_t> occupiedKeys;  // keys of the occupied cells, sorted
+static std::vector<uint64_t> particleKeys;  // cell key of each particle
+static std::vector<uint32_t> stencilCells;  // cell id at each neighborStencil offset of each cell
+static std::vector<uint32_t> halfOffsets;   // neighborStencil index of each halfStencil offset
+
+// Verlet neighbor lists, built with radius H + skin and reused while particles stay inside the skin
+static std::vector<uint32_t> verletStart;      // first entry of each particle, plus end sentinel
+static std::vector<uint32_t> verletNeighbors;  // neighbor indices of all particles
+static std::vector<Vector2r> verletPositions;  // positions when the lists were built
+static uint64_t verletBuilds = 0;
+
+// symmetric pair mode, every thread accumulates into its own row and the rows are summed afterwards
+static std::vector<Accum> threadDensities;  // NUM_THREADS rows of one density per particle
+static std::vector<Vector2a> threadForces;  // NUM_THREADS rows of one force per particle
+
+// adaptive smoothing lengths, particles are binned into grid levels of doubling cell size by h
+static constexpr Real H_MIN           = H / 4.0f;
+static constexpr Real H_MAX           = H * 2.0f;
+static constexpr uint32_t NUM_LEVELS  = 3;      // cell sizes 2 H_MIN, 4 H_MIN and 8 H_MIN = H_MAX
+static constexpr Real H_RELAXATION    = 0.01f;  // part of the way to its target h moves per step
+static bool levelOccupied[NUM_LEVELS] = {};
+static std::vector<uint32_t> neighborCounts;  // neighbors of each particle in the density pass
+
+// pair cache, the density pass records every interacting pair for the force pass of the same step
+struct CachedPair
+{
+    uint32_t neighbor;
+    Real r;
+    Vector2r direction;  // unit vector from the particle towards the neighbor
+};
+static std::vector<std::vector<CachedPair>> threadPairs;  // pairs recorded by each thread
+static std::vector<std::vector<std::pair<uint32_t, uint32_t>>>
+    threadPairOwners;  // particle and end of its pairs, per thread
+static uint64_t cachedPairsTotal = 0;
+static size_t pairCacheBytes     = 0;
+static size_t pairCachePeakBytes = 0;
+
+// cell-ordered traversal, the particles of one cell share a gathered copy of their stencil block
+struct BlockEntry
+{
+    Vector2r position;
+    uint32_t id;
+};
+static std::vector<std::vector<BlockEntry>> threadBlocks;  // block of the current cell, per thread
+
+// SIMD batch kernels, the candidates of a particle are staged into lane-aligned arrays
+using RealVector = SimdVector<Real>;
+struct NeighborBatch
+{
+    std::vector<uint32_t> ids;
+    AlignedVector<Real> x, y, vx, vy, density, pressure;
+};
+static thread_local NeighborBatch neighborBatch;  // staging arrays of this thread
+
+// cluster pairs, the cell-sorted particles are cut into runs of clusterSize and every pair of
+// clusters whose bounding boxes come within H is evaluated as one dense tile. A cluster may be as
+// wide as a vector, so the 16 float lanes of AVX-512 hold one cluster without padding
+static constexpr uint32_t MAX_CLUSTER_SIZE = std::max(8u, RealVector::WIDTH);
+static uint32_t CLUSTER_STRIDE             = 0;  // slots per cluster, padded to whole vectors
+static uint32_t numClusters                = 0;
+static std::vector<uint32_t> clusterIds;  // particle of each slot, NOT_FOUND for padding
+static AlignedVector<Real> clusterX, clusterY, clusterVx, clusterVy;
+static AlignedVector<Real> clusterDensity, clusterPressure;  // written by the density pass
+static std::vector<AlignedBox<Real, 2>> clusterBounds;
+static std::vector<uint32_t> clusterPairStart;  // first entry of each cluster, plus end sentinel
+static std::vector<uint32_t> clusterPairs;      // neighbor clusters of all clusters
+static thread_local std::vector<uint32_t> clusterCandidates;  // scratch of BuildClusters
+static uint64_t clusterPairsTotal = 0;
+static uint64_t clustersTotal     = 0;
+
+// render thread, the solver publishes finished steps into a triple buffer that Render() reads
+struct DrawParticle
+{
+    Vector2r position;
+    Real radius;
+};
+static constexpr uint32_t FRESH_FRAME = 4;  // set in latestFrame until the renderer takes it
+static std::vector<DrawParticle> frames[3];
+static uint32_t writeFrame = 0;                // only touched by the solver
+static uint32_t readFrame  = 1;                // only touched by the renderer
+static std::atomic<uint32_t> latestFrame {2};  // the third frame, plus FRESH_FRAME once published
+static std::thread solverThread;
+static std::atomic<bool> solverReady {false};  // set once the solver thread has initialized
 
 // Thread
 static unsigned int NUM_THREADS = 1;
-std::vector<std::thread> threads;
+static ParallelBackend parallelBackend;
+
+// first touch, the particle loops compare their ranges with the slices the pages were placed for
+static uint32_t touchCount      = 0;             // leading elements TouchPages splits up
+static uint32_t placedParticles = 0;             // particles the pages were split for
+static std::atomic<uint64_t> placedVisits {0};   // particles the checked loops ran
+static std::atomic<uint64_t> foreignVisits {0};  // of those, particles placed by another thread
+
+// per-phase thread counts, each phase times a few steps per candidate count and keeps the fastest
+enum class Phase
+{
+    Density,
+    Forces,
+    Integrate,
+    Grid,    // cell grid build, including the cell hash
+    Reduce,  // sums of the per-thread buffers of the symmetric passes
+    Lists,   // Verlet lists and cluster pairs
+    Count,
+};
+struct PhaseTuning
+{
+    uint32_t threads      = 0;    // thread count in use, 0 before the first tuning
+    uint32_t candidate    = 0;    // thread count being timed, 0 once tuned
+    uint32_t limit        = 0;    // largest candidate of the current tuning
+    uint32_t samples      = 0;    // timed steps of the candidate so far
+    double time           = 0.0;  // seconds spent by the candidate so far
+    double bestTime       = 0.0;
+    uint32_t tunedCount   = 0;      // particle count the choice was made for
+    uint32_t settledSteps = 0;      // steps since the choice was made
+    double stepTime       = 0.0;    // seconds of the phase in the current step
+    bool ran              = false;  // the phase ran in the current step
+};
+static constexpr uint32_t MIN_PARTICLES_PER_THREAD = 128;  // fewer is not worth the handoff
+static constexpr uint32_t TUNING_SAMPLES           = 8;    // timed steps per candidate
+static constexpr uint32_t RETUNE_STEPS             = 1000;
+static PhaseTuning phaseTunings[(int)Phase::Count];
+static const char* PHASE_NAMES[(int)Phase::Count] =
+    {"density", "forces", "integrate", "grid", "reduce", "lists"};
+
+// Profiling, per-thread busy time and work of every phase, summed over the loops of a step
+struct alignas(64) ThreadProfile
+{
+    double busy        = 0.0;  // seconds spent inside chunks
+    uint64_t particles = 0;
+    uint64_t pairs     = 0;  // neighbor candidates visited
+};
+struct PhaseProfile
+{
+    uint64_t calls       = 0;
+    double wall          = 0.0;
+    double imbalanceSum  = 0.0;  // max over mean busy time, summed over calls
+    double imbalanceMax  = 0.0;
+    double idleSum       = 0.0;  // thread seconds not spent in chunks
+    double threadTimeSum = 0.0;  // wall time times active threads
+    std::vector<ThreadProfile> threads;
+    std::vector<ThreadProfile> step;  // the current step, one entry per thread
+    double stepWall      = 0.0;
+    uint32_t stepThreads = 0;  // most threads a loop of the phase ran on in the current step
+};
+static thread_local uint64_t profiledPairs = 0;  // pairs visited by this thread so far
+static PhaseProfile phaseProfiles[(int)Phase::Count];
+static std::ofstream profileCsv;
 
 // interaction
 static constexpr int MAX_PARTICLES   = 2500;
@@ -83,20 +280,140 @@ void InitSDL();
 void Render();
 void Shutdown();
 
+// Render thread
+void PublishFrame();
+bool AcquireFrame();
+void SolverLoop();
+
 // Solver
+void InitSolver();
 void InitSPH();
+void PlaceParticles();
 void Integrate();
+void IntegrateRange(uint32_t begin, uint32_t end);
 void ComputeDensityPressure();
+void ComputeDensityPressureAt(uint32_t i, uint32_t t);
 void ComputeForces();
+void ComputeForcesAt(uint32_t i);
+void ComputeCachedForces(uint32_t row);
+void ComputeDensityPressureCell(uint32_t cellId, uint32_t t);
+void ComputeForcesCell(uint32_t cellId, uint32_t t);
+uint32_t CellParticles(uint32_t begin, uint32_t end);
+const std::vector<BlockEntry>& GatherCellBlock(uint32_t cellId, uint32_t t);
+template<typename K = Kernel>
+void AddPairForces(const typename K::Coefficients& kernel,
+                   uint32_t i,
+                   uint32_t j,
+                   const Vector2r& direction,
+                   Real r,
+                   Vector2a& force);
+uint32_t StageNeighbors(uint32_t i, bool forces);
+void ComputeDensityPressureBatch(uint32_t i);
+void ComputeForcesBatch(uint32_t i);
+void ComputeDensityPressureSymmetric();
+void ComputeForcesSymmetric();
+void ComputeDensityPressureAdaptive();
+void ComputeForcesAdaptive();
+void UpdateSmoothingLengths();
+void ResetPairCache();
+void MeasurePairCache();
 void Update();
+void UpdateFused();
+void ReorderParticles();
+void PrintStats();
 
 // Cells
+void InitCells();
 void BuildCells();
+void PrepareCells();
+void CountCells(uint32_t t);
+void SumCellBlock(uint32_t t);
+void ScanCellBlockSums();
+void ScanCellBlock(uint32_t t);
+void ScatterCells(uint32_t t);
 uint32_t CellPositionToId(uint32_t ix, uint32_t iy);
-std::vector<uint32_t> Neighbors(Particle& particle);
+uint32_t CellCoordinate(Real position, uint32_t numCells);
+void BuildCellHash();
+void RehashCells();
+void NumberCells();
+uint64_t CellKey(int32_t ix, int32_t iy);
+void CellKeyCoordinates(uint64_t key, int& ix, int& iy);
+uint64_t ParticleCellKey(uint32_t i);
+uint32_t SmoothingLevel(Real h);
+Real LevelCellSize(uint32_t level);
+uint32_t HashFind(uint64_t key);
+void HashInsert(uint64_t key, uint32_t cellId);
+void ResizeHash(uint32_t capacity);
+void GridCellCoordinates(const Vector2r& position, int& ix, int& iy);
+uint32_t GridCellId(int ix, int iy);
+const uint32_t* StencilCells(uint32_t cellId);
+Real CellDistance2(const Vector2r& position, int jx, int jy, Real cellSize);
+std::vector<Vector2i> BuildStencil(Real radius);
+template<typename Func>
+void ForEachGridNeighbor(const Vector2r& position,
+                         const std::vector<Vector2i>& stencil,
+                         Real radius,
+                         const uint32_t* cells,
+                         Func&& func);
+template<typename Func>
+void ForEachNeighbor(uint32_t i, Func&& func);
+template<typename Func>
+void ForEachHalfNeighbor(uint32_t slot, Func&& func);
+template<typename Func>
+void ForEachAdaptiveNeighbor(uint32_t i, Func&& func);
+
+// Verlet lists
+bool NeighborListsExpired();
+void BuildNeighborLists();
+
+// Clusters
+void BuildClusters();
+void FillCluster(uint32_t cluster);
+void ComputeDensityPressureClusters();
+void ComputeForcesClusters();
+void ComputeDensityPressureCluster(uint32_t cluster);
+void ComputeForcesCluster(uint32_t cluster);
+uint32_t ClusterParticles(uint32_t begin, uint32_t end);
 
 // Thread
 void InitThreads();
+template<typename Func>
+void RunThreads(Func&& func);
+template<typename Func>
+void RunThreads(uint32_t numThreads, Func&& func);
+template<typename Func>
+void RunPhase(Phase phase, uint32_t numThreads, Func&& func);
+template<typename Func>
+void ParallelFor(Phase phase, uint32_t count, Func&& func);
+template<typename Func, typename ParticlesIn>
+void ParallelFor(Phase phase, uint32_t count, Func&& func, ParticlesIn&& particlesIn);
+template<typename Func>
+void ParallelChunks(Phase phase, uint32_t count, Func&& func);
+template<typename Func, typename ParticlesIn>
+void ParallelChunks(Phase phase, uint32_t count, Func&& func, ParticlesIn&& particlesIn);
+uint32_t PhaseThreads(Phase phase, uint32_t count);
+void RecordPhaseTime(Phase phase, uint32_t numThreads, double seconds);
+void FinishPhaseTimes();
+std::pair<uint32_t, uint32_t> ThreadRange(uint32_t count,
+                                          uint32_t t,
+                                          uint32_t numThreads = NUM_THREADS);
+template<typename T>
+void FirstTouch(AlignedVector<T>& buffer, uint32_t capacity, uint32_t count);
+void TouchPages(void* storage, std::size_t count, std::size_t size);
+void CheckPlacement(uint32_t t, uint32_t begin, uint32_t end);
+
+// Profiling
+void InitProfile();
+void CountPairs(uint32_t count);
+template<typename Func>
+void ProfileThread(Phase phase, uint32_t t, uint64_t particles, Func&& func);
+void FinishPhaseProfiles();
+void PrintProfile();
+
+// Options
+void ParseOptions(int argc, char* argv[]);
+template<typename T>
+bool ParseValue(std::string_view text, T& value);
 
 // Interactivity
 void Keyboard(SDL_Scancode code);
@@ -132,14 +449,21 @@ void InitSDL()
 
 void Render()
 {
+    if (!AcquireFrame() && options.asyncRender)
+    {
+        // nothing new from the solver, so do not draw the same frame again
+        SDL_Delay(1);
+        return;
+    }
+
     SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
     SDL_RenderClear(renderer);
-    for (auto& particle : particles)
+    for (const DrawParticle& particle : frames[readFrame])
     {
         filledCircleRGBA(renderer,
                          particle.position[0],
                          particle.position[1],
-                         H / 2,
+                         particle.radius,
                          0.2f * 255,
                          0.6f * 255,
                          255,
@@ -150,243 +474,2806 @@ void Render()
 
 void Shutdown()
 {
+    if (solverThread.joinable())
+    {
+        solverThread.join();
+    }
+    PrintStats();
+    parallelBackend.Stop();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
 }
 
+void PublishFrame()
+{
+    // copies the particles in id order into the write frame, then swaps it with the third frame.
+    // Neither side ever waits, the renderer just skips frames the solver replaced in between
+    auto& frame = frames[writeFrame];
+    frame.clear();
+    for (uint32_t index : particleIndex)
+    {
+        frame.push_back({particles.Position(index), particles.h[index] / 2});
+    }
+    writeFrame = latestFrame.exchange(writeFrame | FRESH_FRAME, std::memory_order_acq_rel)
+                 & ~FRESH_FRAME;
+}
+
+bool AcquireFrame()
+{
+    if (!(latestFrame.load(std::memory_order_relaxed) & FRESH_FRAME))
+    {
+        return false;
+    }
+    readFrame = latestFrame.exchange(readFrame, std::memory_order_acq_rel) & ~FRESH_FRAME;
+    return true;
+}
+
+void SolverLoop()
+{
+    while (isRunning)
+    {
+        Update();
+        PublishFrame();
+    }
+}
+
+void InitSolver()
+{
+    // runs on the thread that steps the solver, which becomes worker 0 of the pool. It is pinned
+    // with the workers and first touches slice 0 of the buffers, where it will also run it
+    InitThreads();
+    InitSPH();
+    if (options.firstTouch)
+    {
+        PlaceParticles();
+    }
+    InitCells();
+    InitProfile();
+}
+
 void InitSPH()
 {
     std::cout << "initializing dam break with " << DAM_PARTICLES << " particles" << std::endl;
 
-    for (float y = EPS; y < VIEW_HEIGHT - EPS * 2.0f; y += H)
+    for (Real y = EPS; y < VIEW_HEIGHT - EPS * 2.0f; y += H)
     {
-        for (float x = VIEW_WIDTH / 4; x <= VIEW_WIDTH / 2; x += H)
+        for (Real x = VIEW_WIDTH / 4; x <= VIEW_WIDTH / 2; x += H)
         {
-            if (particles.size() >= DAM_PARTICLES)
+            if (particles.Size() >= DAM_PARTICLES)
             {
                 return;
             }
-            float jitter = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-            particles.push_back(Particle(x + jitter, y));
+            Real jitter = static_cast<Real>(rand()) / static_cast<Real>(RAND_MAX);
+            particleIndex.push_back(particles.Size());
+            particles.Add(x + jitter, y, H, particles.Size());
         }
     }
 }
 
+void PlaceParticles()
+{
+    // the buffers are sized for every particle the keyboard can add, so they never move to the
+    // main thread's node by reallocating. The dam is split over the threads as the passes split
+    // it, the spare capacity is left to the thread that adds a particle there
+    placedParticles = particles.Size();
+    particles.ForEachArray([](auto& values)
+                           { FirstTouch(values, MAX_PARTICLES, placedParticles); });
+    sortedParticles.ForEachArray([](auto& values)
+                                 { FirstTouch(values, MAX_PARTICLES, placedParticles); });
+    FirstTouch(particleCells, MAX_PARTICLES, placedParticles);
+    FirstTouch(cellEntries, MAX_PARTICLES, placedParticles);
+}
+
 void Integrate()
 {
-    for (auto& particle : particles)
-    {
-        // forward Euler integration
-        particle.velocity += DT * particle.force / particle.density;
-        particle.position += DT * particle.velocity;
+    ParallelChunks(Phase::Integrate,
+                   particles.Size(),
+                   [](uint32_t, uint32_t begin, uint32_t end) { IntegrateRange(begin, end); });
+}
 
-        // enforce boundary conditions
-        if (particle.position(0) - EPS < 0.0f)
-        {
-            particle.velocity(0) *= BOUND_DAMPING;
-            particle.position(0) = EPS;
-        }
-        if (particle.position(0) + EPS > VIEW_WIDTH)
-        {
-            particle.velocity(0) *= BOUND_DAMPING;
-            particle.position(0) = VIEW_WIDTH - EPS;
-        }
-        if (particle.position(1) - EPS < 0.0f)
-        {
-            particle.velocity(1) *= BOUND_DAMPING;
-            particle.position(1) = EPS;
-        }
-        if (particle.position(1) + EPS > VIEW_HEIGHT)
-        {
-            particle.velocity(1) *= BOUND_DAMPING;
-            particle.position(1) = VIEW_HEIGHT - EPS;
-        }
-    }
+void IntegrateRange(uint32_t begin, uint32_t end)
+{
+    // forward Euler integration, as array expressions over the contiguous particle arrays
+    const Real low = EPS, highX = VIEW_WIDTH - EPS, highY = VIEW_HEIGHT - EPS;
+    auto x         = ArrayView(particles.x, begin, end);
+    auto y         = ArrayView(particles.y, begin, end);
+    auto vx        = ArrayView(particles.vx, begin, end);
+    auto vy        = ArrayView(particles.vy, begin, end);
+    auto density   = ArrayView(particles.density, begin, end);
+    vx += DT * ArrayView(particles.fx, begin, end) / density;
+    vy += DT * ArrayView(particles.fy, begin, end) / density;
+    x += DT * vx;
+    y += DT * vy;
+
+    // enforce boundary conditions, with selects and clamps instead of a branch per wall
+    vx = ((x < low) || (x > highX)).select(vx * BOUND_DAMPING, vx);
+    vy = ((y < low) || (y > highY)).select(vy * BOUND_DAMPING, vy);
+    x  = x.max(low).min(highX);
+    y  = y.max(low).min(highY);
 }
 
 void ComputeDensityPressure()
 {
-    threads.clear();
-    int size = (int)std::ceil(particles.size() / (float)NUM_THREADS);
-    for (int t = 0; t < NUM_THREADS; ++t)
+    ResetPairCache();
+    if (options.cellOrder)
     {
-        threads.emplace_back(
-            [size](int startIndex)
-            {
-                int end = std::min(startIndex + size, (int)particles.size());
-                for (int i = startIndex; i < end; ++i)
-                {
-                    auto& pi   = particles[i];
-                    pi.density = 0.0f;
-                    for (uint32_t neighborId : Neighbors(pi))
+        threadBlocks.resize(NUM_THREADS);
+        ParallelChunks(Phase::Density,
+                       numGridCells,
+                       [](uint32_t t, uint32_t begin, uint32_t end)
+                       {
+                           for (uint32_t cellId = begin; cellId < end; ++cellId)
+                           {
+                               ComputeDensityPressureCell(cellId, t);
+                           }
+                       },
+                       CellParticles);
+        MeasurePairCache();
+        return;
+    }
+
+    ParallelChunks(Phase::Density,
+                   particles.Size(),
+                   [](uint32_t t, uint32_t begin, uint32_t end)
+                   {
+                       if (options.firstTouch)
+                       {
+                           CheckPlacement(t, begin, end);
+                       }
+                       for (uint32_t i = begin; i < end; ++i)
+                       {
+                           ComputeDensityPressureAt(i, t);
+                       }
+                   });
+    MeasurePairCache();
+}
+
+void ComputeDensityPressureAt(uint32_t i, uint32_t t)
+{
+    if (options.simd)
+    {
+        ComputeDensityPressureBatch(i);
+        return;
+    }
+
+    const Vector2r position = particles.Position(i);
+    Accum density           = 0.0f;
+    ForEachNeighbor(i,
+                    [&](uint32_t neighborId)
                     {
-                        auto& pj     = particles[neighborId];
-                        Vector2d rij = pj.position - pi.position;
-                        float r2     = rij.squaredNorm();
+                        Vector2r rij = particles.Position(neighborId) - position;
+                        Real r2      = rij.squaredNorm();
 
                         if (r2 < HSQ)
                         {
                             // this computation is symmetric
-                            pi.density += MASS * POLY6 * std::pow(HSQ - r2, 3.0f);
+                            density += MASS * Kernel::Density(KERNEL, r2);
+                            if (options.pairCache && neighborId != i)
+                            {
+                                threadPairs[t].push_back(
+                                    {neighborId, std::sqrt(r2), rij.normalized()});
+                            }
                         }
-                    }
-                    pi.pressure = GAS_CONST * (pi.density - REST_DENS);
-                }
-            },
-            t * size);
+                    });
+    particles.density[i]  = density;
+    particles.pressure[i] = GAS_CONST * (density - REST_DENS);
+    if (options.pairCache)
+    {
+        threadPairOwners[t].emplace_back(i, (uint32_t)threadPairs[t].size());
     }
+}
 
-    for (int t = 0; t < NUM_THREADS; ++t)
+void ComputeDensityPressureCell(uint32_t cellId, uint32_t t)
+{
+    // same sums as ComputeDensityPressureAt, the block lists the candidates in the same order
+    const std::vector<BlockEntry>& block = GatherCellBlock(cellId, t);
+    for (uint32_t k = cellStart[cellId]; k < cellStart[cellId + 1]; ++k)
     {
-        threads[t].join();
+        uint32_t i              = cellEntries[k];
+        const Vector2r position = particles.Position(i);
+        Accum density           = 0.0f;
+        for (const BlockEntry& entry : block)
+        {
+            Vector2r rij = entry.position - position;
+            Real r2      = rij.squaredNorm();
+
+            if (r2 < HSQ)
+            {
+                density += MASS * Kernel::Density(KERNEL, r2);
+                if (options.pairCache && entry.id != i)
+                {
+                    threadPairs[t].push_back(
+                        {entry.id, std::sqrt(r2), rij.normalized()});
+                }
+            }
+        }
+        particles.density[i]  = density;
+        particles.pressure[i] = GAS_CONST * (density - REST_DENS);
+        if (options.pairCache)
+        {
+            threadPairOwners[t].emplace_back(i, (uint32_t)threadPairs[t].size());
+        }
     }
 }
 
 void ComputeForces()
 {
-    threads.clear();
-    int size = (int)std::ceil(particles.size() / (float)NUM_THREADS);
-    for (int t = 0; t < NUM_THREADS; ++t)
+    if (options.pairCache)
     {
-        threads.emplace_back(
-            [size](int startIndex)
-            {
-                int end = std::min(startIndex + size, (int)particles.size());
-                for (int i = startIndex; i < end; ++i)
-                {
-                    auto& pi = particles[i];
-                    Vector2d fpress(0.0f, 0.0f);
-                    Vector2d fvisc(0.0f, 0.0f);
+        // the threads walk the rows the density pass recorded, which already followed the
+        // schedule. Rows past the density pass's thread count are empty
+        const uint32_t numThreads = PhaseThreads(Phase::Forces, particles.Size());
+        RunPhase(Phase::Forces,
+                 numThreads,
+                 [numThreads](uint32_t t)
+                 {
+                     for (uint32_t row = t; row < NUM_THREADS; row += numThreads)
+                     {
+                         ComputeCachedForces(row);
+                     }
+                 });
+        return;
+    }
+
+    if (options.cellOrder)
+    {
+        threadBlocks.resize(NUM_THREADS);
+        ParallelChunks(Phase::Forces,
+                       numGridCells,
+                       [](uint32_t t, uint32_t begin, uint32_t end)
+                       {
+                           for (uint32_t cellId = begin; cellId < end; ++cellId)
+                           {
+                               ComputeForcesCell(cellId, t);
+                           }
+                       },
+                       CellParticles);
+        return;
+    }
+
+    ParallelChunks(Phase::Forces,
+                   particles.Size(),
+                   [](uint32_t t, uint32_t begin, uint32_t end)
+                   {
+                       if (options.firstTouch)
+                       {
+                           CheckPlacement(t, begin, end);
+                       }
+                       for (uint32_t i = begin; i < end; ++i)
+                       {
+                           ComputeForcesAt(i);
+                       }
+                   });
+}
+
+void ComputeForcesAt(uint32_t i)
+{
+    if (options.simd)
+    {
+        ComputeForcesBatch(i);
+        return;
+    }
 
-                    for (uint32_t neighborId : Neighbors(pi))
+    const Vector2r position = particles.Position(i);
+    Vector2a force          = G.cast<Accum>() * MASS / particles.density[i];
+    ForEachNeighbor(i,
+                    [&](uint32_t neighborId)
                     {
-                        auto& pj = particles[neighborId];
-                        if (&pi == &pj)
+                        if (neighborId == i)
                         {
-                            continue;
+                            return;
                         }
 
-                        Vector2d rij = pj.position - pi.position;
-                        float r      = rij.norm();
+                        Vector2r rij = particles.Position(neighborId) - position;
+                        Real r       = rij.norm();
 
                         if (r < H)
                         {
-                            // compute pressure force contribution
-                            fpress += -rij.normalized() * MASS * (pi.pressure + pj.pressure)
-                                      / (2.0f * pj.density) * SPIKY_GRAD * std::pow(H - r, 3.0f);
-                            // compute viscosity force contribution
-                            fvisc += VISC * MASS * (pj.velocity - pi.velocity) / pj.density
-                                     * VISC_LAP * (H - r);
+                            AddPairForces(KERNEL, i, neighborId, rij.normalized(), r, force);
                         }
-                    }
-                    Vector2d fgrav = G * MASS / pi.density;
-                    pi.force       = fpress + fvisc + fgrav;
-                }
-            },
-            t * size);
-    }
+                    });
+    particles.fx[i] = force(0);
+    particles.fy[i] = force(1);
+}
 
-    for (int t = 0; t < NUM_THREADS; ++t)
+void ComputeForcesCell(uint32_t cellId, uint32_t t)
+{
+    const std::vector<BlockEntry>& block = GatherCellBlock(cellId, t);
+    for (uint32_t k = cellStart[cellId]; k < cellStart[cellId + 1]; ++k)
     {
-        threads[t].join();
+        uint32_t i              = cellEntries[k];
+        const Vector2r position = particles.Position(i);
+        Vector2a force          = G.cast<Accum>() * MASS / particles.density[i];
+        for (const BlockEntry& entry : block)
+        {
+            if (entry.id == i)
+            {
+                continue;
+            }
+
+            Vector2r rij = entry.position - position;
+            Real r       = rij.norm();
+
+            if (r < H)
+            {
+                AddPairForces(KERNEL, i, entry.id, rij.normalized(), r, force);
+            }
+        }
+        particles.fx[i] = force(0);
+        particles.fy[i] = force(1);
     }
 }
 
-void Update()
+uint32_t CellParticles(uint32_t begin, uint32_t end)
 {
-    BuildCells();
-    ComputeDensityPressure();
-    ComputeForces();
-    Integrate();
+    // particles of the cells [begin, end), most cell ids of the dense grid are empty
+    return cellStart[end] - cellStart[begin];
 }
 
-void BuildCells()
+const std::vector<BlockEntry>& GatherCellBlock(uint32_t cellId, uint32_t t)
 {
-    cells.clear();
-    cells.resize(CELL_NX * CELL_NY);
+    // copies the positions of the stencil cells around a cell into one contiguous block, which
+    // then stays in L1 while every particle of the cell runs over it
+    std::vector<BlockEntry>& block = threadBlocks[t];
+    block.clear();
+    if (cellStart[cellId] == cellStart[cellId + 1])
+    {
+        return block;
+    }
 
-    for (uint32_t i = 0; i < particles.size(); ++i)
+    const uint32_t* cells = StencilCells(cellId);
+    int ix, iy;
+    GridCellCoordinates(particles.Position(cellEntries[cellStart[cellId]]), ix, iy);
+    for (uint32_t s = 0; s < neighborStencil.size(); ++s)
     {
-        auto& particle  = particles[i];
-        uint32_t ix     = (uint32_t)(particle.position(0) / H);
-        uint32_t iy     = (uint32_t)(particle.position(1) / H);
-        uint32_t cellId = CellPositionToId(ix, iy);
-        cells[cellId].push_back(i);
+        const Vector2i& offset = neighborStencil[s];
+        uint32_t neighborCell  = cells ? cells[s] : GridCellId(ix + offset(0), iy + offset(1));
+        if (neighborCell == NOT_FOUND)
+        {
+            continue;
+        }
+        for (uint32_t k = cellStart[neighborCell]; k < cellStart[neighborCell + 1]; ++k)
+        {
+            uint32_t id = cellEntries[k];
+            block.push_back({particles.Position(id), id});
+        }
     }
+    CountPairs((uint32_t)block.size() * (cellStart[cellId + 1] - cellStart[cellId]));
+    return block;
 }
 
-uint32_t CellPositionToId(uint32_t ix, uint32_t iy)
+void ComputeCachedForces(uint32_t row)
+{
+    // replays the pairs thread row recorded in the density pass
+    const auto& pairs = threadPairs[row];
+    uint32_t k        = 0;
+    for (auto [i, end] : threadPairOwners[row])
+    {
+        Vector2a force = G.cast<Accum>() * MASS / particles.density[i];
+        for (; k < end; ++k)
+        {
+            const CachedPair& pair = pairs[k];
+            AddPairForces(KERNEL, i, pair.neighbor, pair.direction, pair.r, force);
+        }
+        particles.fx[i] = force(0);
+        particles.fy[i] = force(1);
+    }
+}
+
+template<typename K>
+void AddPairForces(const typename K::Coefficients& kernel,
+                   uint32_t i,
+                   uint32_t j,
+                   const Vector2r& direction,
+                   Real r,
+                   Vector2a& force)
 {
-    return CELL_NX * iy + ix;
+    // kernel holds the coefficients of K for the smoothing length of the pair
+    // compute pressure force contribution
+    Vector2r fpress = -direction * MASS * (particles.pressure[i] + particles.pressure[j])
+                      / (2.0f * particles.density[j]) * K::Gradient(kernel, r);
+    // compute viscosity force contribution
+    Vector2r fvisc = VISC * MASS * (particles.Velocity(j) - particles.Velocity(i))
+                     / particles.density[j] * K::Laplacian(kernel, r);
+    force += (fpress + fvisc).cast<Accum>();
 }
 
-std::vector<uint32_t> Neighbors(Particle& particle)
+uint32_t StageNeighbors(uint32_t i, bool forces)
 {
-    uint32_t ix = (uint32_t)(particle.position(0) / H);
-    uint32_t iy = (uint32_t)(particle.position(1) / H);
+    // copies the candidates of particle i into neighborBatch, padded to whole vectors with
+    // lanes 2H away so that the range mask of the kernels drops them, returns the padded count
+    NeighborBatch& batch = neighborBatch;
+    batch.ids.clear();
+    ForEachNeighbor(i, [&batch](uint32_t neighborId) { batch.ids.push_back(neighborId); });
 
-    std::vector<uint32_t> result;
-    for (auto dx : {-1, 0, 1})
+    const uint32_t count  = (uint32_t)batch.ids.size();
+    const uint32_t padded = (count + RealVector::WIDTH - 1) / RealVector::WIDTH * RealVector::WIDTH;
+    batch.x.resize(padded);
+    batch.y.resize(padded);
+    for (uint32_t k = 0; k < count; ++k)
     {
-        for (auto dy : {-1, 0, 1})
-        {
-            uint32_t jx = ix + dx;
-            uint32_t jy = iy + dy;
-            if (jx >= 0 && jx < CELL_NX && jy >= 0 && jy < CELL_NY)
-            {
-                uint32_t neighborId                    = CellPositionToId(jx, jy);
-                std::vector<uint32_t>& neighborsInCell = cells[neighborId];
-                result.insert(result.end(), neighborsInCell.begin(), neighborsInCell.end());
-            }
-        }
+        batch.x[k] = particles.x[batch.ids[k]];
+        batch.y[k] = particles.y[batch.ids[k]];
     }
-    return result;
+    std::fill(batch.x.begin() + count, batch.x.end(), particles.x[i] + 2.0f * H);
+    std::fill(batch.y.begin() + count, batch.y.end(), particles.y[i]);
+    if (!forces)
+    {
+        return padded;
+    }
+
+    batch.vx.resize(padded);
+    batch.vy.resize(padded);
+    batch.density.resize(padded);
+    batch.pressure.resize(padded);
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        uint32_t j        = batch.ids[k];
+        batch.vx[k]       = particles.vx[j];
+        batch.vy[k]       = particles.vy[j];
+        batch.density[k]  = particles.density[j];
+        batch.pressure[k] = particles.pressure[j];
+    }
+    std::fill(batch.vx.begin() + count, batch.vx.end(), 0.0f);
+    std::fill(batch.vy.begin() + count, batch.vy.end(), 0.0f);
+    std::fill(batch.density.begin() + count, batch.density.end(), 1.0f);
+    std::fill(batch.pressure.begin() + count, batch.pressure.end(), 0.0f);
+    return padded;
 }
 
-void InitThreads()
+void ComputeDensityPressureBatch(uint32_t i)
 {
-    NUM_THREADS = std::thread::hardware_concurrency();
-    std::cout << "concurrency = " << NUM_THREADS << std::endl;
+    // the kernel over RealVector::WIDTH candidates at a time, the mass is applied once to the
+    // sum. Each lane sums its share of the neighbors in Accum
+    const uint32_t count       = StageNeighbors(i, false);
+    const NeighborBatch& batch = neighborBatch;
+    const RealVector px        = RealVector::Broadcast(particles.x[i]);
+    const RealVector py        = RealVector::Broadcast(particles.y[i]);
+    const RealVector hsq       = RealVector::Broadcast(HSQ);
+    const RealVector zero      = RealVector::Broadcast(0.0f);
+    SimdSum<Accum, Real> sum;
+    for (uint32_t k = 0; k < count; k += RealVector::WIDTH)
+    {
+        RealVector dx = RealVector::Load(&batch.x[k]) - px;
+        RealVector dy = RealVector::Load(&batch.y[k]) - py;
+        RealVector r2 = dx * dx + dy * dy;
+        sum.Add(Blend(r2 < hsq, Kernel::Analytic::Density(KERNEL, r2), zero));
+    }
+
+    Accum density         = MASS * sum.Reduce();
+    particles.density[i]  = density;
+    particles.pressure[i] = GAS_CONST * (density - REST_DENS);
 }
 
-int main(int argc, char* argv[])
+void ComputeForcesBatch(uint32_t i)
 {
-    InitSDL();
-    InitSPH();
-    InitThreads();
-
-    auto mainLoop = []()
+    // the pressure and viscosity terms of AddPairForces, with the direction folded into 1 / r.
+    // The particle itself comes up with r = 0, where both terms are zero
+    const uint32_t count       = StageNeighbors(i, true);
+    const NeighborBatch& batch = neighborBatch;
+    const RealVector px        = RealVector::Broadcast(particles.x[i]);
+    const RealVector py        = RealVector::Broadcast(particles.y[i]);
+    const RealVector pvx       = RealVector::Broadcast(particles.vx[i]);
+    const RealVector pvy       = RealVector::Broadcast(particles.vy[i]);
+    const RealVector pressure  = RealVector::Broadcast(particles.pressure[i]);
+    const RealVector h         = RealVector::Broadcast(H);
+    const RealVector zero      = RealVector::Broadcast(0.0f);
+    const RealVector one       = RealVector::Broadcast(1.0f);
+    const RealVector pressCoef = RealVector::Broadcast(-MASS / 2.0f);
+    const RealVector viscCoef  = RealVector::Broadcast(VISC * MASS);
+    SimdSum<Accum, Real> fx, fy;
+    for (uint32_t k = 0; k < count; k += RealVector::WIDTH)
     {
-#ifdef __EMSCRIPTEN__
-        if (!isRunning)
-        {
-            emscripten_cancel_main_loop();
-            Shutdown();
-            return;
-        }
-#endif
+        RealVector dx         = RealVector::Load(&batch.x[k]) - px;
+        RealVector dy         = RealVector::Load(&batch.y[k]) - py;
+        RealVector r          = Sqrt(dx * dx + dy * dy);
+        RealVector gradient   = Kernel::Analytic::Gradient(KERNEL, r);
+        RealVector invDensity = one / RealVector::Load(&batch.density[k]);
+        RealVector invR       = Blend(zero < r, one / r, zero);
+        RealVector pj         = RealVector::Load(&batch.pressure[k]);
+        RealVector press      = pressCoef * (pressure + pj) * invDensity * gradient * invR;
+        RealVector visc       = viscCoef * invDensity * Kernel::Analytic::Laplacian(KERNEL, r);
+        RealVector dvx        = RealVector::Load(&batch.vx[k]) - pvx;
+        RealVector dvy        = RealVector::Load(&batch.vy[k]) - pvy;
+        RealVector::Mask near = r < h;
+        fx.Add(Blend(near, press * dx + visc * dvx, zero));
+        fy.Add(Blend(near, press * dy + visc * dvy, zero));
+    }
 
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
+    Vector2a force = G.cast<Accum>() * MASS / particles.density[i];
+    force(0) += fx.Reduce();
+    force(1) += fy.Reduce();
+    particles.fx[i] = force(0);
+    particles.fy[i] = force(1);
+}
+
+void ComputeDensityPressureSymmetric()
+{
+    // one row per thread of the density pass, the pass below gets the same count
+    const uint32_t numParticles = particles.Size();
+    const uint32_t numThreads   = PhaseThreads(Phase::Density, numParticles);
+    threadDensities.resize(numThreads * numParticles);
+    ResetPairCache();
+    RunPhase(Phase::Density,
+             numThreads,
+             [numParticles](uint32_t t)
+             {
+                 Accum* densities = &threadDensities[t * numParticles];
+                 std::fill(densities, densities + numParticles, 0.0f);
+             });
+    ParallelChunks(
+        Phase::Density,
+        numParticles,
+        [numParticles](uint32_t t, uint32_t begin, uint32_t end)
         {
-            switch (event.type)
+            Accum* densities = &threadDensities[t * numParticles];
+            auto& pairs      = threadPairs[t];
+            auto& owners     = threadPairOwners[t];
+            for (uint32_t slot = begin; slot < end; ++slot)
             {
-                case SDL_QUIT:
-                    isRunning = false;
-                    break;
+                uint32_t owner = NOT_FOUND;
+                ForEachHalfNeighbor(slot,
+                                    [&](uint32_t i, uint32_t j)
+                                    {
+                                        Vector2r rij =
+                                            particles.Position(j) - particles.Position(i);
+                                        Real r2 = rij.squaredNorm();
 
-                default:
-                    break;
+                                        if (r2 < HSQ)
+                                        {
+                                            Real density = MASS * Kernel::Density(KERNEL, r2);
+                                            densities[i] += density;
+                                            densities[j] += density;
+                                            if (options.pairCache)
+                                            {
+                                                pairs.push_back({j,
+                                                                 std::sqrt(r2),
+                                                                 rij.normalized()});
+                                                owner = i;
+                                            }
+                                        }
+                                    });
+                if (owner != NOT_FOUND)
+                {
+                    owners.emplace_back(owner, (uint32_t)pairs.size());
+                }
             }
-        }
+        });
+    MeasurePairCache();
 
-        auto state = SDL_GetKeyboardState(NULL);
-        if (state[SDL_SCANCODE_ESCAPE])
-        {
-            isRunning = false;
-        }
+    ParallelFor(Phase::Reduce,
+                numParticles,
+                [numParticles, numThreads](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        // a particle is not its own half neighbor, so add its own contribution here
+                        Accum density = MASS * Kernel::Density(KERNEL, Real(0));
+                        for (uint32_t t = 0; t < numThreads; ++t)
+                        {
+                            density += threadDensities[t * numParticles + i];
+                        }
+                        particles.density[i]  = density;
+                        particles.pressure[i] = GAS_CONST * (density - REST_DENS);
+                    }
+                });
+}
 
-        Update();
+void ComputeForcesSymmetric()
+{
+    // one row per thread of the force pass, the pass below gets the same count
+    const uint32_t numParticles = particles.Size();
+    const uint32_t numThreads   = PhaseThreads(Phase::Forces, numParticles);
+    threadForces.resize(numThreads * numParticles);
+
+    // shared part of the pressure and viscosity terms, each side divides by the density of the
+    // other particle
+    auto addForces =
+        [](Vector2a* forces, uint32_t i, uint32_t j, const Vector2r& direction, Real r)
+    {
+        Vector2r fpress = -direction * MASS * (particles.pressure[i] + particles.pressure[j]) / 2.0f
+                          * Kernel::Gradient(KERNEL, r);
+        Vector2r fvisc = VISC * MASS * (particles.Velocity(j) - particles.Velocity(i))
+                         * Kernel::Laplacian(KERNEL, r);
+        forces[i] += ((fpress + fvisc) / particles.density[j]).cast<Accum>();
+        forces[j] -= ((fpress + fvisc) / particles.density[i]).cast<Accum>();
+    };
+
+    RunPhase(Phase::Forces,
+             numThreads,
+             [&addForces, numParticles, numThreads](uint32_t t)
+             {
+                 Vector2a* forces = &threadForces[t * numParticles];
+                 std::fill(forces, forces + numParticles, Vector2a::Zero());
+                 if (!options.pairCache)
+                 {
+                     return;
+                 }
+
+                 // rows of the density pass, which may have run on another thread count
+                 for (uint32_t row = t; row < NUM_THREADS; row += numThreads)
+                 {
+                     const auto& pairs = threadPairs[row];
+                     uint32_t k        = 0;
+                     for (auto [i, end] : threadPairOwners[row])
+                     {
+                         for (; k < end; ++k)
+                         {
+                             const CachedPair& pair = pairs[k];
+                             addForces(forces, i, pair.neighbor, pair.direction, pair.r);
+                         }
+                     }
+                 }
+             });
+
+    if (!options.pairCache)
+    {
+        ParallelChunks(
+            Phase::Forces,
+            numParticles,
+            [&addForces, numParticles](uint32_t t, uint32_t begin, uint32_t end)
+            {
+                Vector2a* forces = &threadForces[t * numParticles];
+                for (uint32_t slot = begin; slot < end; ++slot)
+                {
+                    ForEachHalfNeighbor(slot,
+                                        [&](uint32_t i, uint32_t j)
+                                        {
+                                            Vector2r rij =
+                                                particles.Position(j) - particles.Position(i);
+                                            Real r = rij.norm();
+
+                                            if (r < H)
+                                            {
+                                                addForces(forces, i, j, rij.normalized(), r);
+                                            }
+                                        });
+                }
+            });
+    }
+
+    ParallelFor(Phase::Reduce,
+                numParticles,
+                [numParticles, numThreads](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        Vector2a force = G.cast<Accum>() * MASS / particles.density[i];
+                        for (uint32_t t = 0; t < numThreads; ++t)
+                        {
+                            force += threadForces[t * numParticles + i];
+                        }
+                        particles.fx[i] = force(0);
+                        particles.fy[i] = force(1);
+                    }
+                });
+}
+
+void ComputeDensityPressureAdaptive()
+{
+    const uint32_t numParticles = particles.Size();
+    neighborCounts.resize(numParticles);
+    ParallelChunks(Phase::Density,
+                   numParticles,
+                   [](uint32_t t, uint32_t begin, uint32_t end)
+                   {
+                       if (options.firstTouch)
+                       {
+                           CheckPlacement(t, begin, end);
+                       }
+                       for (uint32_t i = begin; i < end; ++i)
+                       {
+                           const Vector2r position = particles.Position(i);
+                           Accum density           = 0.0f;
+                           uint32_t count          = 0;
+                           ForEachAdaptiveNeighbor(
+                               i,
+                               [&](uint32_t neighborId)
+                               {
+                                   Vector2r rij = particles.Position(neighborId) - position;
+                                   Real r2      = rij.squaredNorm();
+                                   Real h       = 0.5f * (particles.h[i] + particles.h[neighborId]);
+                                   Real h2      = h * h;
+
+                                   if (r2 < h2)
+                                   {
+                                       // same kernel as the fixed H solver, scaled to h
+                                       const auto kernel = Kernel::Analytic::For(h);
+                                       density += MASS * Kernel::Analytic::Density(kernel, r2);
+                                       count += neighborId != i;
+                                   }
+                               });
+                           particles.density[i]  = density;
+                           particles.pressure[i] = GAS_CONST * (density - REST_DENS);
+                           neighborCounts[i]     = count;
+                       }
+                   });
+}
+
+void ComputeForcesAdaptive()
+{
+    ParallelChunks(Phase::Forces,
+                   particles.Size(),
+                   [](uint32_t t, uint32_t begin, uint32_t end)
+                   {
+                       if (options.firstTouch)
+                       {
+                           CheckPlacement(t, begin, end);
+                       }
+                       for (uint32_t i = begin; i < end; ++i)
+                       {
+                           const Vector2r position = particles.Position(i);
+                           Vector2a force          = G.cast<Accum>() * MASS / particles.density[i];
+                           ForEachAdaptiveNeighbor(
+                               i,
+                               [&](uint32_t neighborId)
+                               {
+                                   if (neighborId == i)
+                                   {
+                                       return;
+                                   }
+
+                                   uint32_t j   = neighborId;
+                                   Vector2r rij = particles.Position(j) - position;
+                                   Real r       = rij.norm();
+                                   Real h       = 0.5f * (particles.h[i] + particles.h[j]);
+
+                                   if (r < h)
+                                   {
+                                       // the tables only hold H, so h goes through Analytic
+                                       AddPairForces<Kernel::Analytic>(Kernel::Analytic::For(h),
+                                                                       i,
+                                                                       j,
+                                                                       rij.normalized(),
+                                                                       r,
+                                                                       force);
+                                   }
+                               });
+                           particles.fx[i] = force(0);
+                           particles.fy[i] = force(1);
+                       }
+                   });
+}
+
+void UpdateSmoothingLengths()
+{
+    // in 2D the neighbor count grows with h^2, so the target scales H by the square root of the
+    // count ratio. Relaxing towards a target derived from H, rather than compounding the ratio
+    // onto h, keeps h stable where the particle spacing itself follows h
+    ParallelFor(Phase::Integrate,
+                particles.Size(),
+                [](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        Real ratio  = (Real)options.adaptiveNeighbors
+                                     / std::max(neighborCounts[i], 1u);
+                        Real target = std::clamp(H * std::sqrt(ratio), H_MIN, H_MAX);
+                        particles.h[i] += H_RELAXATION * (target - particles.h[i]);
+                    }
+                });
+}
+
+void ResetPairCache()
+{
+    // the vectors keep their capacity, so recording allocates only while the cache grows
+    threadPairs.resize(NUM_THREADS);
+    threadPairOwners.resize(NUM_THREADS);
+    for (uint32_t t = 0; t < NUM_THREADS; ++t)
+    {
+        threadPairs[t].clear();
+        threadPairOwners[t].clear();
+    }
+}
+
+void MeasurePairCache()
+{
+    if (!options.pairCache)
+    {
+        return;
+    }
+
+    pairCacheBytes = 0;
+    for (uint32_t t = 0; t < NUM_THREADS; ++t)
+    {
+        cachedPairsTotal += threadPairs[t].size();
+        pairCacheBytes += threadPairs[t].capacity() * sizeof(CachedPair)
+                          + threadPairOwners[t].capacity() * sizeof(std::pair<uint32_t, uint32_t>);
+    }
+    pairCachePeakBytes = std::max(pairCachePeakBytes, pairCacheBytes);
+}
+
+void Update()
+{
+    if (options.fused)
+    {
+        UpdateFused();
+        return;
+    }
+
+    bool useLists = options.verletSkin > 0.0f;
+    if (!useLists || NeighborListsExpired())
+    {
+        BuildCells();
+        if (options.reorderInterval > 0 && stepCount >= nextReorderStep)
+        {
+            RunPhase(Phase::Grid, 1, [](uint32_t) { ReorderParticles(); });
+            nextReorderStep = stepCount + options.reorderInterval;
+        }
+        if (useLists)
+        {
+            BuildNeighborLists();
+        }
+    }
+    if (options.adaptiveNeighbors > 0)
+    {
+        ComputeDensityPressureAdaptive();
+        ComputeForcesAdaptive();
+        UpdateSmoothingLengths();
+    }
+    else if (options.symmetric)
+    {
+        ComputeDensityPressureSymmetric();
+        ComputeForcesSymmetric();
+    }
+    else if (options.clusterSize > 0)
+    {
+        BuildClusters();
+        ComputeDensityPressureClusters();
+        ComputeForcesClusters();
+    }
+    else
+    {
+        ComputeDensityPressure();
+        ComputeForces();
+    }
+    Integrate();
+    FinishPhaseTimes();
+    ++stepCount;
+}
+
+void UpdateFused()
+{
+    // the whole step in one parallel region. Phases are separated by barriers, and every thread
+    // keeps its ThreadRange slice of particles from the grid build through the integration
+    const uint32_t numParticles = particles.Size();
+    bool reorder                = options.reorderInterval > 0 && stepCount >= nextReorderStep;
+    cellThreads                 = NUM_THREADS;
+    PrepareCells();
+    ResetPairCache();
+    RunThreads(
+        [numParticles, reorder](uint32_t t)
+        {
+            // every part ends at a barrier, thread 0 times the part from its start to the barrier
+            auto [begin, end] = ThreadRange(numParticles, t);
+            auto part         = [t](Phase phase, uint32_t particles, auto&& work)
+            {
+                auto start = std::chrono::steady_clock::now();
+                ProfileThread(phase, t, particles, work);
+                parallelBackend.Barrier();
+                if (t == 0)
+                {
+                    std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                    RecordPhaseTime(phase, NUM_THREADS, elapsed.count());
+                }
+            };
+
+            part(Phase::Grid, 0, [t]() { CountCells(t); });
+            part(Phase::Grid, 0, [t]() { SumCellBlock(t); });
+            part(Phase::Grid,
+                 0,
+                 [t]()
+                 {
+                     if (t == 0)
+                     {
+                         ScanCellBlockSums();
+                     }
+                 });
+            part(Phase::Grid, 0, [t]() { ScanCellBlock(t); });
+            part(Phase::Grid, 0, [t]() { ScatterCells(t); });
+            if (reorder)
+            {
+                part(Phase::Grid,
+                     0,
+                     [t]()
+                     {
+                         if (t == 0)
+                         {
+                             ReorderParticles();
+                         }
+                     });
+            }
+
+            part(Phase::Density,
+                 end - begin,
+                 [t, begin, end]()
+                 {
+                     if (options.firstTouch)
+                     {
+                         CheckPlacement(t, begin, end);
+                     }
+                     for (uint32_t i = begin; i < end; ++i)
+                     {
+                         ComputeDensityPressureAt(i, t);
+                     }
+                 });
+            part(Phase::Forces,
+                 end - begin,
+                 [t, begin, end]()
+                 {
+                     if (options.pairCache)
+                     {
+                         ComputeCachedForces(t);
+                         return;
+                     }
+                     if (options.firstTouch)
+                     {
+                         CheckPlacement(t, begin, end);
+                     }
+                     for (uint32_t i = begin; i < end; ++i)
+                     {
+                         ComputeForcesAt(i);
+                     }
+                 });
+            part(Phase::Integrate, end - begin, [begin, end]() { IntegrateRange(begin, end); });
+        });
+    MeasurePairCache();
+
+    if (reorder)
+    {
+        nextReorderStep = stepCount + options.reorderInterval;
+    }
+    FinishPhaseTimes();
+    ++stepCount;
+}
+
+void ReorderParticles()
+{
+    // the grid already lists the particles sorted along the Morton curve, so store them that way
+    const uint32_t numParticles = particles.Size();
+    sortedParticles.Gather(particles, cellEntries.data());
+    particles.Swap(sortedParticles);
+
+    for (uint32_t cellId = 0; cellId < numGridCells; ++cellId)
+    {
+        for (uint32_t k = cellStart[cellId]; k < cellStart[cellId + 1]; ++k)
+        {
+            cellEntries[k]   = k;
+            particleCells[k] = cellId;
+        }
+    }
+    for (uint32_t i = 0; i < numParticles; ++i)
+    {
+        particleIndex[particles.id[i]] = i;
+    }
+}
+
+void PrintStats()
+{
+    if (options.profile)
+    {
+        PrintProfile();
+    }
+    if (options.threads == 0)
+    {
+        std::cout << "threads per phase:";
+        for (int phase = 0; phase < (int)Phase::Count; ++phase)
+        {
+            // the pair cache replays forces on the threads of the density pass
+            if (phaseTunings[phase].threads > 0)
+            {
+                std::cout << " " << PHASE_NAMES[phase] << " " << phaseTunings[phase].threads;
+            }
+        }
+        std::cout << " (of " << NUM_THREADS << ")" << std::endl;
+    }
+    if (options.firstTouch)
+    {
+        uint64_t visits  = placedVisits.load(std::memory_order_relaxed);
+        uint64_t foreign = foreignVisits.load(std::memory_order_relaxed);
+        std::cout << "first touch: " << foreign << " of " << visits
+                  << " particles of the density and force loops ran on another thread than the "
+                     "one that placed them"
+                  << std::endl;
+    }
+    if (options.verletSkin > 0.0f)
+    {
+        std::cout << "neighbor lists built " << verletBuilds << " times in " << stepCount
+                  << " steps (every " << (verletBuilds ? stepCount / (double)verletBuilds : 0.0)
+                  << " steps on average)" << std::endl;
+    }
+    if (options.adaptiveNeighbors > 0)
+    {
+        uint32_t levelCounts[NUM_LEVELS] = {};
+        double sumH                      = 0.0;
+        for (Real h : particles.h)
+        {
+            ++levelCounts[SmoothingLevel(h)];
+            sumH += h;
+        }
+        std::cout << "smoothing length: mean " << sumH / particles.Size()
+                  << ", particles per level";
+        for (uint32_t level = 0; level < NUM_LEVELS; ++level)
+        {
+            std::cout << " " << levelCounts[level];
+        }
+        std::cout << std::endl;
+    }
+    if (options.clusterSize > 0)
+    {
+        double pairsPerStep    = stepCount ? clusterPairsTotal / (double)stepCount : 0.0;
+        double clustersPerStep = stepCount ? clustersTotal / (double)stepCount : 0.0;
+        std::cout << "cluster pairs: " << pairsPerStep << " per step ("
+                  << (clustersPerStep > 0.0 ? pairsPerStep / clustersPerStep : 0.0)
+                  << " per cluster), "
+                  << (clustersPerStep > 0.0 ? particles.Size() / clustersPerStep : 0.0)
+                  << " particles per cluster of " << options.clusterSize << std::endl;
+    }
+    if (options.pairCache)
+    {
+        double pairsPerStep = stepCount ? cachedPairsTotal / (double)stepCount : 0.0;
+        std::cout << "pair cache: " << pairsPerStep << " pairs per step ("
+                  << pairsPerStep / particles.Size() << " per particle), "
+                  << pairCacheBytes / 1024.0 << " KiB now, " << pairCachePeakBytes / 1024.0
+                  << " KiB peak" << std::endl;
+    }
+}
+
+void InitCells()
+{
+    CELL_SIZE = H / options.cellDivisions;
+    CELL_NX   = (uint32_t)std::ceil(VIEW_WIDTH / CELL_SIZE);
+    CELL_NY   = (uint32_t)std::ceil(VIEW_HEIGHT / CELL_SIZE);
+
+    // Morton ids grow with both coordinates, so the last cell has the largest id
+    NUM_CELLS = CellPositionToId(CELL_NX - 1, CELL_NY - 1) + 1;
+
+    neighborStencil = BuildStencil(H);
+    verletStencil   = BuildStencil(H + options.verletSkin);
+    halfStencil.clear();
+    halfOffsets.clear();
+    for (uint32_t s = 0; s < neighborStencil.size(); ++s)
+    {
+        const Vector2i& offset = neighborStencil[s];
+        if (offset(1) > 0 || (offset(1) == 0 && offset(0) > 0))
+        {
+            halfStencil.push_back(offset);
+            halfOffsets.push_back(s);
+        }
+    }
+
+    if (options.firstTouch && options.grid == GridType::Dense)
+    {
+        // thread t touches histogram row t, which is the row it counts into
+        FirstTouch(cellStart, NUM_CELLS + 1, NUM_CELLS + 1);
+        FirstTouch(cellCounts, NUM_THREADS * NUM_CELLS, NUM_THREADS * NUM_CELLS);
+    }
+
+    std::cout << "cells = " << CELL_NX << " x " << CELL_NY << " (" << NUM_CELLS << " ids), "
+              << "stencil of " << neighborStencil.size() << " cells" << std::endl;
+
+    if (options.clusterSize > 0)
+    {
+        const uint32_t width = RealVector::WIDTH;
+        CLUSTER_STRIDE       = (options.clusterSize + width - 1) / width * width;
+        std::cout << "clusters of " << options.clusterSize << " particles in " << CLUSTER_STRIDE
+                  << " slots" << std::endl;
+        if (options.clusterSize < width)
+        {
+            std::cout << "--clusters=" << width << " fills the " << width << " lanes" << std::endl;
+        }
+    }
+}
+
+void BuildCells()
+{
+    // parallel counting sort of particle indices by cell on the threads of the grid phase,
+    // buffers keep their capacity across steps
+    cellThreads = PhaseThreads(Phase::Grid, particles.Size());
+    PrepareCells();
+    RunPhase(Phase::Grid, cellThreads, CountCells);
+    RunPhase(Phase::Grid, cellThreads, SumCellBlock);
+    RunPhase(Phase::Grid, 1, [](uint32_t) { ScanCellBlockSums(); });
+    RunPhase(Phase::Grid, cellThreads, ScanCellBlock);
+    RunPhase(Phase::Grid, cellThreads, ScatterCells);
+}
+
+void PrepareCells()
+{
+    const uint32_t numParticles = particles.Size();
+    particleCells.resize(numParticles);
+    if (options.grid == GridType::Hash)
+    {
+        BuildCellHash();
+    }
+    else
+    {
+        numGridCells = NUM_CELLS;
+    }
+
+    cellStart.resize(numGridCells + 1);
+    cellEntries.resize(numParticles);
+    cellCounts.resize(cellThreads * numGridCells);
+    cellBlockSums.resize(cellThreads + 1);
+    cellStart[numGridCells] = numParticles;
+}
+
+void CountCells(uint32_t t)
+{
+    // each thread owns one histogram row, so no counter is shared between threads
+    uint32_t* counts = &cellCounts[t * numGridCells];
+    std::fill(counts, counts + numGridCells, 0);
+
+    auto [begin, end] = ThreadRange(particles.Size(), t, cellThreads);
+    if (options.grid == GridType::Hash)
+    {
+        // cells were already assigned by BuildCellHash
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            ++counts[particleCells[i]];
+        }
+        return;
+    }
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        uint32_t ix      = CellCoordinate(particles.x[i], CELL_NX);
+        uint32_t iy      = CellCoordinate(particles.y[i], CELL_NY);
+        uint32_t cellId  = CellPositionToId(ix, iy);
+        particleCells[i] = cellId;
+        ++counts[cellId];
+    }
+}
+
+void SumCellBlock(uint32_t t)
+{
+    auto [begin, end] = ThreadRange(numGridCells, t, cellThreads);
+    uint32_t sum      = 0;
+    for (uint32_t cellId = begin; cellId < end; ++cellId)
+    {
+        for (uint32_t u = 0; u < cellThreads; ++u)
+        {
+            sum += cellCounts[u * numGridCells + cellId];
+        }
+    }
+    cellBlockSums[t + 1] = sum;
+}
+
+void ScanCellBlockSums()
+{
+    cellBlockSums[0] = 0;
+    for (uint32_t t = 0; t < cellThreads; ++t)
+    {
+        cellBlockSums[t + 1] += cellBlockSums[t];
+    }
+}
+
+void ScanCellBlock(uint32_t t)
+{
+    // turns the counts into scatter cursors ordered by cell, then by thread,
+    // which gives the same entry order as a serial build
+    auto [begin, end] = ThreadRange(numGridCells, t, cellThreads);
+    uint32_t offset   = cellBlockSums[t];
+    for (uint32_t cellId = begin; cellId < end; ++cellId)
+    {
+        cellStart[cellId] = offset;
+        for (uint32_t u = 0; u < cellThreads; ++u)
+        {
+            uint32_t& count = cellCounts[u * numGridCells + cellId];
+            uint32_t next   = offset + count;
+            count           = offset;
+            offset          = next;
+        }
+    }
+}
+
+void ScatterCells(uint32_t t)
+{
+    uint32_t* cursors = &cellCounts[t * numGridCells];
+    auto [begin, end] = ThreadRange(particles.Size(), t, cellThreads);
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        cellEntries[cursors[particleCells[i]]++] = i;
+    }
+}
+
+uint32_t CellPositionToId(uint32_t ix, uint32_t iy)
+{
+    // interleave the bits of ix and iy (Z-order) so that nearby cells get nearby ids
+    auto spread = [](uint32_t v)
+    {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(ix) | (spread(iy) << 1);
+}
+
+uint32_t CellCoordinate(Real position, uint32_t numCells)
+{
+    // clamp so that particles outside the view still map to a valid cell
+    Real cell = std::floor(position / CELL_SIZE);
+    return (uint32_t)std::clamp(cell, Real(0), (Real)(numCells - 1));
+}
+
+void BuildCellHash()
+{
+    // keys and cell ids in one parallel pass. The numbering of the last rehash is kept while its
+    // table holds the cell of every particle, cells that emptied since then stay in the grid
+    // without particles. Only a particle entering a cell outside the table costs a rehash
+    const uint32_t numParticles = particles.Size();
+    particleKeys.resize(numParticles);
+    std::atomic<bool> missing {hashKeys.empty()};
+    ParallelFor(Phase::Grid,
+                numParticles,
+                [&missing](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        particleKeys[i] = ParticleCellKey(i);
+                        if (missing.load(std::memory_order_relaxed))
+                        {
+                            continue;
+                        }
+                        uint32_t slot = HashFind(particleKeys[i]);
+                        if (slot == NOT_FOUND)
+                        {
+                            missing.store(true, std::memory_order_relaxed);
+                            continue;
+                        }
+                        particleCells[i] = hashCells[slot];
+                    }
+                });
+    if (missing)
+    {
+        RehashCells();
+    }
+}
+
+void RehashCells()
+{
+    // number the occupied cells on one thread, then look up the cell of every particle
+    const uint32_t numParticles = particles.Size();
+    RunPhase(Phase::Grid, 1, [](uint32_t) { NumberCells(); });
+
+    ParallelFor(Phase::Grid,
+                numParticles,
+                [](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        particleCells[i] = hashCells[HashFind(particleKeys[i])];
+                    }
+                });
+    if (options.adaptiveNeighbors > 0)
+    {
+        // the adaptive search probes the cells of every level itself
+        return;
+    }
+
+    // resolve the stencil of every cell once, so the passes index its row instead of hashing
+    // each stencil cell for each particle. The cells are not counted yet, so the particles are
+    // spread evenly over them for the thread count
+    const uint32_t stencilSize = (uint32_t)neighborStencil.size();
+    stencilCells.resize(numGridCells * stencilSize);
+    ParallelFor(
+        Phase::Grid,
+        numGridCells,
+        [stencilSize](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t cellId = begin; cellId < end; ++cellId)
+            {
+                int ix, iy;
+                CellKeyCoordinates(occupiedKeys[cellId], ix, iy);
+                uint32_t* row = &stencilCells[cellId * stencilSize];
+                for (uint32_t s = 0; s < stencilSize; ++s)
+                {
+                    row[s] = GridCellId(ix + neighborStencil[s](0), iy + neighborStencil[s](1));
+                }
+            }
+        },
+        [numParticles](uint32_t begin, uint32_t end)
+        { return (uint32_t)((uint64_t)numParticles * (end - begin) / numGridCells); });
+}
+
+void NumberCells()
+{
+    // collect the occupied cells, sizing the table from the previous step so it stays half empty
+    const uint32_t numParticles = particles.Size();
+    uint32_t capacity           = 64;
+    while (capacity < 2 * occupiedKeys.size())
+    {
+        capacity *= 2;
+    }
+    occupiedKeys.clear();
+    ResizeHash(capacity);
+    for (uint32_t i = 0; i < numParticles; ++i)
+    {
+        if (HashFind(particleKeys[i]) == NOT_FOUND)
+        {
+            occupiedKeys.push_back(particleKeys[i]);
+            HashInsert(particleKeys[i], 0);
+        }
+    }
+
+    // number the occupied cells along the Morton curve, as the dense grid does
+    std::sort(occupiedKeys.begin(), occupiedKeys.end());
+    numGridCells = (uint32_t)occupiedKeys.size();
+    for (uint32_t level = 0; level < NUM_LEVELS; ++level)
+    {
+        // levels live in the top bits of the key, so each level is one run of sorted keys
+        uint64_t levelKey    = (uint64_t)level << 60;
+        auto first           = std::lower_bound(occupiedKeys.begin(), occupiedKeys.end(), levelKey);
+        levelOccupied[level] = first != occupiedKeys.end() && (*first >> 60) == level;
+    }
+    for (uint32_t cellId = 0; cellId < numGridCells; ++cellId)
+    {
+        hashCells[HashFind(occupiedKeys[cellId])] = cellId;
+    }
+}
+
+uint64_t CellKey(int32_t ix, int32_t iy)
+{
+    // Morton code of the cell coordinates, offset so that negative cells are valid too
+    auto spread = [](uint64_t v)
+    {
+        v &= 0x00000000ffffffffull;
+        v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    uint32_t ux = (uint32_t)ix ^ 0x80000000u;
+    uint32_t uy = (uint32_t)iy ^ 0x80000000u;
+    return spread(ux) | (spread(uy) << 1);
+}
+
+void CellKeyCoordinates(uint64_t key, int& ix, int& iy)
+{
+    // inverse of CellKey
+    auto compact = [](uint64_t v)
+    {
+        v &= 0x5555555555555555ull;
+        v = (v | (v >> 1)) & 0x3333333333333333ull;
+        v = (v | (v >> 2)) & 0x0f0f0f0f0f0f0f0full;
+        v = (v | (v >> 4)) & 0x00ff00ff00ff00ffull;
+        v = (v | (v >> 8)) & 0x0000ffff0000ffffull;
+        v = (v | (v >> 16)) & 0x00000000ffffffffull;
+        return (uint32_t)v;
+    };
+    ix = (int)(compact(key) ^ 0x80000000u);
+    iy = (int)(compact(key >> 1) ^ 0x80000000u);
+}
+
+uint64_t ParticleCellKey(uint32_t i)
+{
+    const Vector2r position = particles.Position(i);
+    if (options.adaptiveNeighbors == 0)
+    {
+        return CellKey((int32_t)std::floor(position(0) / CELL_SIZE),
+                       (int32_t)std::floor(position(1) / CELL_SIZE));
+    }
+
+    // multi-level grid, the level replaces the top bits of the Morton code, which only
+    // matter for cells more than 2^29 cells away from the origin
+    uint32_t level = SmoothingLevel(particles.h[i]);
+    Real cellSize  = LevelCellSize(level);
+    uint64_t key   = CellKey((int32_t)std::floor(position(0) / cellSize),
+                           (int32_t)std::floor(position(1) / cellSize));
+    return (key & ((1ull << 60) - 1)) | ((uint64_t)level << 60);
+}
+
+uint32_t SmoothingLevel(Real h)
+{
+    // level whose cell size is the smallest one not below h
+    uint32_t level = 0;
+    while (level + 1 < NUM_LEVELS && h > LevelCellSize(level))
+    {
+        ++level;
+    }
+    return level;
+}
+
+Real LevelCellSize(uint32_t level)
+{
+    return H_MIN * (Real)(2u << level);
+}
+
+uint32_t HashFind(uint64_t key)
+{
+    // linear probing, returns the slot holding key or NOT_FOUND
+    const uint32_t mask = (uint32_t)hashKeys.size() - 1;
+    uint32_t slot       = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    while (hashKeys[slot] != EMPTY_KEY)
+    {
+        if (hashKeys[slot] == key)
+        {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NOT_FOUND;
+}
+
+void HashInsert(uint64_t key, uint32_t cellId)
+{
+    if (2 * (occupiedKeys.size() + 1) > hashKeys.size())
+    {
+        // keep the load factor at or below one half
+        ResizeHash((uint32_t)hashKeys.size() * 2);
+    }
+
+    const uint32_t mask = (uint32_t)hashKeys.size() - 1;
+    uint32_t slot       = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    while (hashKeys[slot] != EMPTY_KEY && hashKeys[slot] != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+    hashKeys[slot]  = key;
+    hashCells[slot] = cellId;
+}
+
+void GridCellCoordinates(const Vector2r& position, int& ix, int& iy)
+{
+    if (options.grid == GridType::Hash)
+    {
+        ix = (int)std::floor(position(0) / CELL_SIZE);
+        iy = (int)std::floor(position(1) / CELL_SIZE);
+    }
+    else
+    {
+        ix = (int)CellCoordinate(position(0), CELL_NX);
+        iy = (int)CellCoordinate(position(1), CELL_NY);
+    }
+}
+
+uint32_t GridCellId(int ix, int iy)
+{
+    // cell id at the coordinates, NOT_FOUND outside the dense grid or for an empty hashed cell
+    if (options.grid == GridType::Hash)
+    {
+        uint32_t slot = HashFind(CellKey(ix, iy));
+        return slot == NOT_FOUND ? NOT_FOUND : hashCells[slot];
+    }
+    if (ix < 0 || ix >= (int)CELL_NX || iy < 0 || iy >= (int)CELL_NY)
+    {
+        return NOT_FOUND;
+    }
+    return CellPositionToId(ix, iy);
+}
+
+const uint32_t* StencilCells(uint32_t cellId)
+{
+    // cell ids at the neighborStencil offsets of a hashed cell, resolved by RehashCells. The dense
+    // grid computes them on the fly, which is cheaper than loading a row
+    if (options.grid != GridType::Hash)
+    {
+        return nullptr;
+    }
+    return &stencilCells[cellId * neighborStencil.size()];
+}
+
+Real CellDistance2(const Vector2r& position, int jx, int jy, Real cellSize)
+{
+    // squared distance from the position to the nearest point of cell (jx, jy)
+    Real x0 = jx * cellSize;
+    Real y0 = jy * cellSize;
+    Real dx = std::max({x0 - position(0), position(0) - (x0 + cellSize), Real(0)});
+    Real dy = std::max({y0 - position(1), position(1) - (y0 + cellSize), Real(0)});
+    return dx * dx + dy * dy;
+}
+
+std::vector<Vector2i> BuildStencil(Real radius)
+{
+    // offsets of the cells that have some point closer than radius to some point of the
+    // center cell, corners beyond the radius are left out
+    int reach = (int)std::ceil(radius / CELL_SIZE);
+    std::vector<Vector2i> stencil;
+    for (int dy = -reach; dy <= reach; ++dy)
+    {
+        for (int dx = -reach; dx <= reach; ++dx)
+        {
+            Real gapX = std::max(std::abs(dx) - 1, 0) * CELL_SIZE;
+            Real gapY = std::max(std::abs(dy) - 1, 0) * CELL_SIZE;
+            if (gapX * gapX + gapY * gapY < radius * radius)
+            {
+                stencil.emplace_back(dx, dy);
+            }
+        }
+    }
+    return stencil;
+}
+
+void ResizeHash(uint32_t capacity)
+{
+    // clears the table, then re-inserts the cells collected so far
+    hashKeys.assign(capacity, EMPTY_KEY);
+    hashCells.resize(capacity);
+    const uint32_t mask = capacity - 1;
+    for (uint64_t key : occupiedKeys)
+    {
+        uint32_t slot = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+        while (hashKeys[slot] != EMPTY_KEY && hashKeys[slot] != key)
+        {
+            slot = (slot + 1) & mask;
+        }
+        hashKeys[slot] = key;
+    }
+}
+
+template<typename Func>
+void ForEachGridNeighbor(const Vector2r& position,
+                         const std::vector<Vector2i>& stencil,
+                         Real radius,
+                         const uint32_t* cells,
+                         Func&& func)
+{
+    // visits the particles of the stencil cells around the position straight from the grid,
+    // skipping cells that are farther than radius from the position itself. cells holds the
+    // resolved ids of the stencil cells, or is nullptr to look them up
+    int ix, iy;
+    GridCellCoordinates(position, ix, iy);
+    const Real radius2 = radius * radius;
+    for (uint32_t s = 0; s < stencil.size(); ++s)
+    {
+        int jx = ix + stencil[s](0);
+        int jy = iy + stencil[s](1);
+        if (CellDistance2(position, jx, jy, CELL_SIZE) >= radius2)
+        {
+            continue;
+        }
+
+        uint32_t cellId = cells ? cells[s] : GridCellId(jx, jy);
+        if (cellId == NOT_FOUND)
+        {
+            continue;
+        }
+        CountPairs(cellStart[cellId + 1] - cellStart[cellId]);
+        for (uint32_t k = cellStart[cellId]; k < cellStart[cellId + 1]; ++k)
+        {
+            func(cellEntries[k]);
+        }
+    }
+}
+
+template<typename Func>
+void ForEachNeighbor(uint32_t i, Func&& func)
+{
+    // candidates within H of particle i, from the cached lists when they are enabled
+    if (options.verletSkin > 0.0f)
+    {
+        CountPairs(verletStart[i + 1] - verletStart[i]);
+        for (uint32_t k = verletStart[i]; k < verletStart[i + 1]; ++k)
+        {
+            func(verletNeighbors[k]);
+        }
+    }
+    else
+    {
+        ForEachGridNeighbor(
+            particles.Position(i), neighborStencil, H, StencilCells(particleCells[i]), func);
+    }
+}
+
+template<typename Func>
+void ForEachHalfNeighbor(uint32_t slot, Func&& func)
+{
+    // visits func(i, j) so that every candidate pair comes up exactly once over all slots
+    if (options.verletSkin > 0.0f)
+    {
+        // in symmetric mode the lists only hold neighbors with a larger index
+        CountPairs(verletStart[slot + 1] - verletStart[slot]);
+        for (uint32_t k = verletStart[slot]; k < verletStart[slot + 1]; ++k)
+        {
+            func(slot, verletNeighbors[k]);
+        }
+        return;
+    }
+
+    // half stencil on the grid, the later entries of the own cell and then the forward half
+    // of the surrounding cells, slot is a position in cellEntries
+    uint32_t i      = cellEntries[slot];
+    uint32_t cellId = particleCells[i];
+    CountPairs(cellStart[cellId + 1] - slot - 1);
+    for (uint32_t k = slot + 1; k < cellStart[cellId + 1]; ++k)
+    {
+        func(i, cellEntries[k]);
+    }
+
+    const Vector2r position = particles.Position(i);
+    const uint32_t* cells   = StencilCells(cellId);
+    int ix, iy;
+    GridCellCoordinates(position, ix, iy);
+    for (uint32_t s = 0; s < halfStencil.size(); ++s)
+    {
+        int jx = ix + halfStencil[s](0);
+        int jy = iy + halfStencil[s](1);
+        if (CellDistance2(position, jx, jy, CELL_SIZE) >= HSQ)
+        {
+            continue;
+        }
+
+        uint32_t neighborCell = cells ? cells[halfOffsets[s]] : GridCellId(jx, jy);
+        if (neighborCell == NOT_FOUND)
+        {
+            continue;
+        }
+        CountPairs(cellStart[neighborCell + 1] - cellStart[neighborCell]);
+        for (uint32_t k = cellStart[neighborCell]; k < cellStart[neighborCell + 1]; ++k)
+        {
+            func(i, cellEntries[k]);
+        }
+    }
+}
+
+template<typename Func>
+void ForEachAdaptiveNeighbor(uint32_t i, Func&& func)
+{
+    // a pair interacts within the mean of both smoothing lengths, which never exceeds the larger
+    // one, so each level is searched with the larger of h and the largest h of that level
+    const Vector2r position = particles.Position(i);
+    for (uint32_t level = 0; level < NUM_LEVELS; ++level)
+    {
+        if (!levelOccupied[level])
+        {
+            continue;
+        }
+
+        Real cellSize      = LevelCellSize(level);
+        Real radius        = std::max(particles.h[i], cellSize);
+        const Real radius2 = radius * radius;
+        int reach          = (int)std::ceil(radius / cellSize);
+        int ix             = (int)std::floor(position(0) / cellSize);
+        int iy             = (int)std::floor(position(1) / cellSize);
+        for (int jy = iy - reach; jy <= iy + reach; ++jy)
+        {
+            for (int jx = ix - reach; jx <= ix + reach; ++jx)
+            {
+                if (CellDistance2(position, jx, jy, cellSize) >= radius2)
+                {
+                    continue;
+                }
+
+                uint64_t key  = CellKey(jx, jy);
+                uint32_t slot = HashFind((key & ((1ull << 60) - 1)) | ((uint64_t)level << 60));
+                if (slot == NOT_FOUND)
+                {
+                    continue;
+                }
+                uint32_t cellId = hashCells[slot];
+                CountPairs(cellStart[cellId + 1] - cellStart[cellId]);
+                for (uint32_t k = cellStart[cellId]; k < cellStart[cellId + 1]; ++k)
+                {
+                    func(cellEntries[k]);
+                }
+            }
+        }
+    }
+}
+
+bool NeighborListsExpired()
+{
+    // the lists stay valid until some particle has moved more than half the skin
+    if (verletPositions.size() != particles.Size())
+    {
+        return true;
+    }
+
+    Real maxDisplacement2 = 0.0f;
+    for (uint32_t i = 0; i < particles.Size(); ++i)
+    {
+        Real displacement2 = (particles.Position(i) - verletPositions[i]).squaredNorm();
+        maxDisplacement2   = std::max(maxDisplacement2, displacement2);
+    }
+    Real halfSkin = 0.5f * options.verletSkin;
+    return maxDisplacement2 > halfSkin * halfSkin;
+}
+
+void BuildNeighborLists()
+{
+    const uint32_t numParticles = particles.Size();
+    const Real radius           = H + options.verletSkin;
+    const Real radius2          = radius * radius;
+
+    auto forEachCandidate = [=](uint32_t i, auto&& func)
+    {
+        const Vector2r position = particles.Position(i);
+        ForEachGridNeighbor(position,
+                            verletStencil,
+                            radius,
+                            nullptr,
+                            [&](uint32_t neighborId)
+                            {
+                                if (options.symmetric && neighborId <= i)
+                                {
+                                    return;
+                                }
+                                if ((particles.Position(neighborId) - position).squaredNorm()
+                                    < radius2)
+                                {
+                                    func(neighborId);
+                                }
+                            });
+    };
+
+    // count, prefix sum, then fill, so that the lists are one contiguous array
+    verletStart.resize(numParticles + 1);
+    verletStart[0] = 0;
+    ParallelFor(Phase::Lists,
+                numParticles,
+                [&](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        uint32_t count = 0;
+                        forEachCandidate(i, [&count](uint32_t) { ++count; });
+                        verletStart[i + 1] = count;
+                    }
+                });
+    RunPhase(Phase::Lists,
+             1,
+             [numParticles](uint32_t)
+             {
+                 for (uint32_t i = 0; i < numParticles; ++i)
+                 {
+                     verletStart[i + 1] += verletStart[i];
+                 }
+             });
+
+    verletNeighbors.resize(verletStart[numParticles]);
+    ParallelFor(Phase::Lists,
+                numParticles,
+                [&](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t i = begin; i < end; ++i)
+                    {
+                        uint32_t k = verletStart[i];
+                        forEachCandidate(i,
+                                         [&k](uint32_t neighborId)
+                                         { verletNeighbors[k++] = neighborId; });
+                    }
+                });
+
+    verletPositions.resize(numParticles);
+    RunPhase(Phase::Lists,
+             1,
+             [numParticles](uint32_t)
+             {
+                 for (uint32_t i = 0; i < numParticles; ++i)
+                 {
+                     verletPositions[i] = particles.Position(i);
+                 }
+             });
+    ++verletBuilds;
+}
+
+void BuildClusters()
+{
+    // cellEntries lists the particles cell by cell along the Morton curve, so consecutive runs
+    // of it are compact clusters, only the last one is padded with empty slots
+    const uint32_t numParticles = particles.Size();
+    numClusters                 = (numParticles + options.clusterSize - 1) / options.clusterSize;
+
+    const uint32_t slots = numClusters * CLUSTER_STRIDE;
+    clusterIds.resize(slots);
+    clusterX.resize(slots);
+    clusterY.resize(slots);
+    clusterVx.resize(slots);
+    clusterVy.resize(slots);
+    clusterDensity.resize(slots);
+    clusterPressure.resize(slots);
+    clusterBounds.resize(numClusters);
+    ParallelFor(Phase::Lists,
+                numClusters,
+                [](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t cluster = begin; cluster < end; ++cluster)
+                    {
+                        FillCluster(cluster);
+                    }
+                },
+                ClusterParticles);
+
+    // candidates are the clusters holding a particle of some cell under the bounding box grown by
+    // H. Every cluster lists all clusters in range including itself, so the passes only write the
+    // particles of their own cluster. Count, prefix sum, then fill, as for the Verlet lists
+    auto forEachCandidate = [](uint32_t cluster, auto&& func)
+    {
+        const AlignedBox<Real, 2>& bounds = clusterBounds[cluster];
+        const Vector2r reach(H, H);
+        int x0, y0, x1, y1;
+        GridCellCoordinates(bounds.min() - reach, x0, y0);
+        GridCellCoordinates(bounds.max() + reach, x1, y1);
+
+        std::vector<uint32_t>& candidates = clusterCandidates;
+        candidates.clear();
+        for (int jy = y0; jy <= y1; ++jy)
+        {
+            for (int jx = x0; jx <= x1; ++jx)
+            {
+                uint32_t cellId = GridCellId(jx, jy);
+                if (cellId == NOT_FOUND || cellStart[cellId] == cellStart[cellId + 1])
+                {
+                    continue;
+                }
+                uint32_t first = cellStart[cellId] / options.clusterSize;
+                uint32_t last  = (cellStart[cellId + 1] - 1) / options.clusterSize;
+                for (uint32_t other = first; other <= last; ++other)
+                {
+                    candidates.push_back(other);
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        for (uint32_t other : candidates)
+        {
+            if (bounds.squaredExteriorDistance(clusterBounds[other]) < HSQ)
+            {
+                func(other);
+            }
+        }
+    };
+
+    clusterPairStart.resize(numClusters + 1);
+    clusterPairStart[0] = 0;
+    ParallelFor(Phase::Lists,
+                numClusters,
+                [&](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t cluster = begin; cluster < end; ++cluster)
+                    {
+                        uint32_t count = 0;
+                        forEachCandidate(cluster, [&count](uint32_t) { ++count; });
+                        clusterPairStart[cluster + 1] = count;
+                    }
+                },
+                ClusterParticles);
+    RunPhase(Phase::Lists,
+             1,
+             [](uint32_t)
+             {
+                 for (uint32_t cluster = 0; cluster < numClusters; ++cluster)
+                 {
+                     clusterPairStart[cluster + 1] += clusterPairStart[cluster];
+                 }
+             });
+
+    clusterPairs.resize(clusterPairStart[numClusters]);
+    ParallelFor(Phase::Lists,
+                numClusters,
+                [&](uint32_t begin, uint32_t end)
+                {
+                    for (uint32_t cluster = begin; cluster < end; ++cluster)
+                    {
+                        uint32_t k = clusterPairStart[cluster];
+                        forEachCandidate(cluster,
+                                         [&k](uint32_t other) { clusterPairs[k++] = other; });
+                    }
+                },
+                ClusterParticles);
+    clusterPairsTotal += clusterPairs.size();
+    clustersTotal += numClusters;
+}
+
+void FillCluster(uint32_t cluster)
+{
+    // copies the particles of the cluster into its slots, padding lies a view away from the view,
+    // out of range of every particle, with a density that keeps the divisions finite
+    const uint32_t first        = cluster * options.clusterSize;
+    const uint32_t last         = std::min(first + options.clusterSize, particles.Size());
+    AlignedBox<Real, 2>& bounds = clusterBounds[cluster];
+    bounds.setEmpty();
+    for (uint32_t slot = 0; slot < CLUSTER_STRIDE; ++slot)
+    {
+        uint32_t k     = cluster * CLUSTER_STRIDE + slot;
+        uint32_t entry = first + slot;
+        if (entry < last)
+        {
+            uint32_t i         = cellEntries[entry];
+            clusterIds[k]      = i;
+            clusterX[k]        = particles.x[i];
+            clusterY[k]        = particles.y[i];
+            clusterVx[k]       = particles.vx[i];
+            clusterVy[k]       = particles.vy[i];
+            clusterDensity[k]  = 1.0f;
+            clusterPressure[k] = 0.0f;
+            bounds.extend(particles.Position(i));
+        }
+        else
+        {
+            clusterIds[k]      = NOT_FOUND;
+            clusterX[k]        = -VIEW_WIDTH;
+            clusterY[k]        = -VIEW_HEIGHT;
+            clusterVx[k]       = 0.0f;
+            clusterVy[k]       = 0.0f;
+            clusterDensity[k]  = 1.0f;
+            clusterPressure[k] = 0.0f;
+        }
+    }
+}
+
+uint32_t ClusterParticles(uint32_t begin, uint32_t end)
+{
+    // every cluster is full but the last one
+    const uint32_t numParticles = particles.Size();
+    return std::min(end * options.clusterSize, numParticles)
+           - std::min(begin * options.clusterSize, numParticles);
+}
+
+void ComputeDensityPressureClusters()
+{
+    ParallelChunks(Phase::Density,
+                   numClusters,
+                   [](uint32_t, uint32_t begin, uint32_t end)
+                   {
+                       for (uint32_t cluster = begin; cluster < end; ++cluster)
+                       {
+                           ComputeDensityPressureCluster(cluster);
+                       }
+                   },
+                   ClusterParticles);
+}
+
+void ComputeForcesClusters()
+{
+    ParallelChunks(Phase::Forces,
+                   numClusters,
+                   [](uint32_t, uint32_t begin, uint32_t end)
+                   {
+                       for (uint32_t cluster = begin; cluster < end; ++cluster)
+                       {
+                           ComputeForcesCluster(cluster);
+                       }
+                   },
+                   ClusterParticles);
+}
+
+void ComputeDensityPressureCluster(uint32_t cluster)
+{
+    // one tile per cluster pair, each vector of the other cluster is loaded once and applied to
+    // every particle of this one, pairs out of range and padding are masked off. The partial sums
+    // of each particle are kept in Accum lanes
+    const uint32_t base = cluster * CLUSTER_STRIDE;
+    uint32_t size       = 0;
+    while (size < options.clusterSize && clusterIds[base + size] != NOT_FOUND)
+    {
+        ++size;
+    }
+
+    const RealVector hsq  = RealVector::Broadcast(HSQ);
+    const RealVector zero = RealVector::Broadcast(0.0f);
+    RealVector px[MAX_CLUSTER_SIZE], py[MAX_CLUSTER_SIZE];
+    SimdSum<Accum, Real> sums[MAX_CLUSTER_SIZE];
+    for (uint32_t a = 0; a < size; ++a)
+    {
+        px[a] = RealVector::Broadcast(clusterX[base + a]);
+        py[a] = RealVector::Broadcast(clusterY[base + a]);
+    }
+
+    for (uint32_t p = clusterPairStart[cluster]; p < clusterPairStart[cluster + 1]; ++p)
+    {
+        const uint32_t other = clusterPairs[p] * CLUSTER_STRIDE;
+        CountPairs(size * CLUSTER_STRIDE);
+        for (uint32_t k = 0; k < CLUSTER_STRIDE; k += RealVector::WIDTH)
+        {
+            RealVector xj = RealVector::Load(&clusterX[other + k]);
+            RealVector yj = RealVector::Load(&clusterY[other + k]);
+            for (uint32_t a = 0; a < size; ++a)
+            {
+                RealVector dx = xj - px[a];
+                RealVector dy = yj - py[a];
+                RealVector r2 = dx * dx + dy * dy;
+                RealVector w  = Kernel::Analytic::Density(KERNEL, r2);
+                sums[a].Add(Blend(r2 < hsq, w, zero));
+            }
+        }
+    }
+
+    for (uint32_t a = 0; a < size; ++a)
+    {
+        uint32_t i                = clusterIds[base + a];
+        Accum density             = MASS * sums[a].Reduce();
+        particles.density[i]      = density;
+        particles.pressure[i]     = GAS_CONST * (density - REST_DENS);
+        clusterDensity[base + a]  = particles.density[i];
+        clusterPressure[base + a] = particles.pressure[i];
+    }
+}
+
+void ComputeForcesCluster(uint32_t cluster)
+{
+    // the terms of ComputeForcesBatch, tiled like ComputeDensityPressureCluster
+    const uint32_t base = cluster * CLUSTER_STRIDE;
+    uint32_t size       = 0;
+    while (size < options.clusterSize && clusterIds[base + size] != NOT_FOUND)
+    {
+        ++size;
+    }
+
+    const RealVector h         = RealVector::Broadcast(H);
+    const RealVector zero      = RealVector::Broadcast(0.0f);
+    const RealVector one       = RealVector::Broadcast(1.0f);
+    const RealVector pressCoef = RealVector::Broadcast(-MASS / 2.0f);
+    const RealVector viscCoef  = RealVector::Broadcast(VISC * MASS);
+    RealVector px[MAX_CLUSTER_SIZE], py[MAX_CLUSTER_SIZE], pvx[MAX_CLUSTER_SIZE],
+        pvy[MAX_CLUSTER_SIZE], pressure[MAX_CLUSTER_SIZE];
+    SimdSum<Accum, Real> fx[MAX_CLUSTER_SIZE], fy[MAX_CLUSTER_SIZE];
+    for (uint32_t a = 0; a < size; ++a)
+    {
+        px[a]       = RealVector::Broadcast(clusterX[base + a]);
+        py[a]       = RealVector::Broadcast(clusterY[base + a]);
+        pvx[a]      = RealVector::Broadcast(clusterVx[base + a]);
+        pvy[a]      = RealVector::Broadcast(clusterVy[base + a]);
+        pressure[a] = RealVector::Broadcast(clusterPressure[base + a]);
+    }
+
+    for (uint32_t p = clusterPairStart[cluster]; p < clusterPairStart[cluster + 1]; ++p)
+    {
+        const uint32_t other = clusterPairs[p] * CLUSTER_STRIDE;
+        CountPairs(size * CLUSTER_STRIDE);
+        for (uint32_t k = 0; k < CLUSTER_STRIDE; k += RealVector::WIDTH)
+        {
+            RealVector xj         = RealVector::Load(&clusterX[other + k]);
+            RealVector yj         = RealVector::Load(&clusterY[other + k]);
+            RealVector vxj        = RealVector::Load(&clusterVx[other + k]);
+            RealVector vyj        = RealVector::Load(&clusterVy[other + k]);
+            RealVector pj         = RealVector::Load(&clusterPressure[other + k]);
+            RealVector invDensity = one / RealVector::Load(&clusterDensity[other + k]);
+            for (uint32_t a = 0; a < size; ++a)
+            {
+                RealVector dx         = xj - px[a];
+                RealVector dy         = yj - py[a];
+                RealVector r          = Sqrt(dx * dx + dy * dy);
+                RealVector gradient   = Kernel::Analytic::Gradient(KERNEL, r);
+                RealVector laplacian  = Kernel::Analytic::Laplacian(KERNEL, r);
+                RealVector invR       = Blend(zero < r, one / r, zero);
+                RealVector press      = pressCoef * (pressure[a] + pj) * invDensity * gradient;
+                RealVector visc       = viscCoef * invDensity * laplacian;
+                RealVector::Mask near = r < h;
+                RealVector fxj        = press * invR * dx + visc * (vxj - pvx[a]);
+                RealVector fyj        = press * invR * dy + visc * (vyj - pvy[a]);
+                fx[a].Add(Blend(near, fxj, zero));
+                fy[a].Add(Blend(near, fyj, zero));
+            }
+        }
+    }
+
+    for (uint32_t a = 0; a < size; ++a)
+    {
+        uint32_t i     = clusterIds[base + a];
+        Vector2a force = G.cast<Accum>() * MASS / particles.density[i];
+        force(0) += fx[a].Reduce();
+        force(1) += fy[a].Reduce();
+        particles.fx[i] = force(0);
+        particles.fy[i] = force(1);
+    }
+}
+
+void InitThreads()
+{
+    // hardware_concurrency() may return 0 when the count is unknown
+    NUM_THREADS = std::max(std::thread::hardware_concurrency(), 1u);
+    if (options.threads > 0)
+    {
+        NUM_THREADS = options.threads;
+    }
+    parallelBackend.Start(NUM_THREADS, options.pinThreads);
+    NUM_THREADS = parallelBackend.Size();  // serial runs one thread, OpenMP at most its limit
+    if (options.firstTouch && options.threads == 0)
+    {
+        // tuned thread counts would cut other slices than the ones the pages were placed for
+        std::cout << "--first-touch runs every phase on all threads" << std::endl;
+        options.threads = NUM_THREADS;
+    }
+    std::cout << "concurrency = " << NUM_THREADS << std::endl;
+    std::cout << "parallel backend = " << PARALLEL_BACKEND << std::endl;
+    std::cout << "precision = " << PRECISION << std::endl;
+    std::cout << "kernel = " << Kernel::NAME << (Kernel::TABULATED ? ", tabulated" : "")
+              << std::endl;
+    if (options.pinThreads && std::is_same_v<ParallelBackend, ThreadPool>)
+    {
+        std::cout << "threads pinned to cpus" << std::endl;
+    }
+}
+
+template<typename Func>
+void RunThreads(Func&& func)
+{
+    // runs func(t) for every thread index t on the backend and waits for all of them
+    parallelBackend.Run([&func](uint32_t t) { func(t); });
+}
+
+template<typename Func>
+void RunThreads(uint32_t numThreads, Func&& func)
+{
+    // runs func(t) for the first numThreads thread indices, a single one runs on the caller
+    if (numThreads == 1)
+    {
+        func(0u);
+        return;
+    }
+    RunThreads(
+        [&func, numThreads](uint32_t t)
+        {
+            if (t < numThreads)
+            {
+                func(t);
+            }
+        });
+}
+
+template<typename Func>
+void RunPhase(Phase phase, uint32_t numThreads, Func&& func)
+{
+    // RunThreads for work that is not split by particles, timed as part of phase. A single thread
+    // runs serial work of the phase on the caller
+    auto start = std::chrono::steady_clock::now();
+    RunThreads(numThreads,
+               [phase, &func](uint32_t t)
+               { ProfileThread(phase, t, 0, [&func, t]() { func(t); }); });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    RecordPhaseTime(phase, numThreads, elapsed.count());
+}
+
+template<typename Func>
+void ParallelFor(Phase phase, uint32_t count, Func&& func)
+{
+    // one item per particle
+    ParallelFor(phase,
+                count,
+                std::forward<Func>(func),
+                [](uint32_t begin, uint32_t end) { return end - begin; });
+}
+
+template<typename Func, typename ParticlesIn>
+void ParallelFor(Phase phase, uint32_t count, Func&& func, ParticlesIn&& particlesIn)
+{
+    // splits [0, count) into one contiguous slice per thread of the phase, the thread count is
+    // tuned for the particles the items cover
+    const uint32_t numThreads = PhaseThreads(phase, particlesIn(0u, count));
+    auto start                = std::chrono::steady_clock::now();
+    RunThreads(numThreads,
+               [&func, &particlesIn, phase, count, numThreads](uint32_t t)
+               {
+                   auto [begin, end] = ThreadRange(count, t, numThreads);
+                   ProfileThread(phase,
+                                 t,
+                                 particlesIn(begin, end),
+                                 [&func, begin, end]() { func(begin, end); });
+               });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    RecordPhaseTime(phase, numThreads, elapsed.count());
+}
+
+template<typename Func>
+void ParallelChunks(Phase phase, uint32_t count, Func&& func)
+{
+    // one item per particle
+    ParallelChunks(phase,
+                   count,
+                   std::forward<Func>(func),
+                   [](uint32_t begin, uint32_t end) { return end - begin; });
+}
+
+template<typename Func, typename ParticlesIn>
+void ParallelChunks(Phase phase, uint32_t count, Func&& func, ParticlesIn&& particlesIn)
+{
+    // calls func(t, begin, end) for chunks covering [0, count) on the first PhaseThreads threads.
+    // The static schedule hands each thread its ThreadRange slice, the dynamic one lets threads
+    // claim grain-sized chunks from a shared counter, so a thread stuck in the dense pool does not
+    // hold up the others. particlesIn(begin, end) counts the particles of a range of items, which
+    // is what the thread counts are tuned for and what the profile reports
+    const uint32_t numThreads = PhaseThreads(phase, particlesIn(0u, count));
+
+    auto run = [&func, &particlesIn, phase](uint32_t t, uint32_t begin, uint32_t end)
+    {
+        ProfileThread(phase,
+                      t,
+                      particlesIn(begin, end),
+                      [&func, t, begin, end]() { func(t, begin, end); });
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (numThreads == 1)
+    {
+        // no handoff at all, which is what small scenes want
+        run(0, 0, count);
+    }
+    else if (options.schedule == Schedule::Static)
+    {
+        RunThreads(
+            [&run, count, numThreads](uint32_t t)
+            {
+                if (t < numThreads)
+                {
+                    auto [begin, end] = ThreadRange(count, t, numThreads);
+                    run(t, begin, end);
+                }
+            });
+    }
+    else
+    {
+        const uint32_t grain = options.grain;
+        std::atomic<uint32_t> nextChunk {0};
+        RunThreads(
+            [&run, &nextChunk, count, grain, numThreads](uint32_t t)
+            {
+                while (t < numThreads)
+                {
+                    uint32_t begin = nextChunk.fetch_add(grain, std::memory_order_relaxed);
+                    if (begin >= count)
+                    {
+                        return;
+                    }
+                    run(t, begin, std::min(begin + grain, count));
+                }
+            });
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    RecordPhaseTime(phase, numThreads, elapsed.count());
+}
+
+uint32_t PhaseThreads(Phase phase, uint32_t count)
+{
+    if (options.threads > 0)
+    {
+        return NUM_THREADS;
+    }
+
+    // starts timing the candidates 1, 2, 4, ... up to the limit the particle count allows when
+    // nothing is tuned yet, the choice is old, or the particle count moved by more than a quarter.
+    // Only the first call of a step may start, so every call of a step runs the same count
+    PhaseTuning& tuning = phaseTunings[(int)phase];
+    bool countChanged   = count * 4 < tuning.tunedCount * 3 || count * 4 > tuning.tunedCount * 5;
+    if (tuning.candidate == 0 && !tuning.ran
+        && (tuning.threads == 0 || countChanged || tuning.settledSteps >= RETUNE_STEPS))
+    {
+        uint32_t wanted   = (count + MIN_PARTICLES_PER_THREAD - 1) / MIN_PARTICLES_PER_THREAD;
+        tuning.limit      = std::clamp(wanted, 1u, NUM_THREADS);
+        tuning.candidate  = 1;
+        tuning.samples    = 0;
+        tuning.time       = 0.0;
+        tuning.bestTime   = 0.0;
+        tuning.tunedCount = count;
+    }
+    return tuning.candidate > 0 ? tuning.candidate : tuning.threads;
+}
+
+void RecordPhaseTime(Phase phase, uint32_t numThreads, double seconds)
+{
+    // a phase may run several loops per step, they add up to one sample in FinishPhaseTimes
+    PhaseTuning& tuning = phaseTunings[(int)phase];
+    tuning.stepTime += seconds;
+    tuning.ran = true;
+    if (options.profile)
+    {
+        PhaseProfile& profile = phaseProfiles[(int)phase];
+        profile.stepWall += seconds;
+        profile.stepThreads = std::max(profile.stepThreads, numThreads);
+    }
+}
+
+void FinishPhaseTimes()
+{
+    // called once per step, after the last phase
+    if (options.profile)
+    {
+        FinishPhaseProfiles();
+    }
+    if (options.threads > 0)
+    {
+        return;
+    }
+
+    for (PhaseTuning& tuning : phaseTunings)
+    {
+        if (!tuning.ran)
+        {
+            continue;
+        }
+        double seconds  = tuning.stepTime;
+        tuning.stepTime = 0.0;
+        tuning.ran      = false;
+        if (tuning.candidate == 0)
+        {
+            ++tuning.settledSteps;
+            continue;
+        }
+
+        tuning.time += seconds;
+        if (++tuning.samples < TUNING_SAMPLES)
+        {
+            continue;
+        }
+        if (tuning.candidate == 1 || tuning.time < tuning.bestTime)
+        {
+            tuning.threads  = tuning.candidate;
+            tuning.bestTime = tuning.time;
+        }
+        tuning.samples   = 0;
+        tuning.time      = 0.0;
+        tuning.candidate = tuning.candidate < tuning.limit
+                               ? std::min(tuning.candidate * 2, tuning.limit)
+                               : 0;
+        if (tuning.candidate == 0)
+        {
+            tuning.settledSteps = 0;
+        }
+    }
+}
+
+std::pair<uint32_t, uint32_t> ThreadRange(uint32_t count, uint32_t t, uint32_t numThreads)
+{
+    uint32_t size  = (count + numThreads - 1) / numThreads;
+    uint32_t begin = std::min(t * size, count);
+    uint32_t end   = std::min(begin + size, count);
+    return {begin, end};
+}
+
+template<typename T>
+void FirstTouch(AlignedVector<T>& buffer, uint32_t capacity, uint32_t count)
+{
+    // moves the buffer into capacity reserved with the allocator placing the pages of its first
+    // count elements, later reallocations are not placed
+    AlignedVector<T> placed;
+    touchCount      = count;
+    firstTouchPages = TouchPages;
+    placed.reserve(capacity);
+    firstTouchPages = nullptr;
+    placed.assign(buffer.begin(), buffer.end());
+    buffer.swap(placed);
+}
+
+void TouchPages(void* storage, std::size_t count, std::size_t size)
+{
+    // Linux places a page on the NUMA node of the thread that writes it first, so the first
+    // touchCount elements are zeroed slice by slice by the thread whose ThreadRange covers them.
+    // The pages of the rest go to whichever thread writes them first
+    char* bytes           = static_cast<char*>(storage);
+    const uint32_t placed = (uint32_t)std::min<std::size_t>(touchCount, count);
+    RunThreads(
+        [bytes, placed, size](uint32_t t)
+        {
+            auto [begin, end] = ThreadRange(placed, t);
+            std::memset(bytes + begin * size, 0, (end - begin) * size);
+        });
+}
+
+void CheckPlacement(uint32_t t, uint32_t begin, uint32_t end)
+{
+    // counts the particles of [begin, end) outside the slice thread t placed. This compares
+    // slices, a page that straddles two slices belongs to one of the two threads
+    auto [placedBegin, placedEnd] = ThreadRange(placedParticles, t);
+    uint32_t first                = std::max(begin, placedBegin);
+    uint32_t owned                = std::max(std::min(end, placedEnd), first) - first;
+    placedVisits.fetch_add(end - begin, std::memory_order_relaxed);
+    foreignVisits.fetch_add(end - begin - owned, std::memory_order_relaxed);
+}
+
+void InitProfile()
+{
+    if (options.profile)
+    {
+        for (PhaseProfile& profile : phaseProfiles)
+        {
+            profile.step.resize(NUM_THREADS);
+        }
+    }
+    if (options.profileCsv.empty())
+    {
+        return;
+    }
+
+    profileCsv.open(options.profileCsv);
+    if (!profileCsv)
+    {
+        std::cout << "cannot write the profile to " << options.profileCsv << std::endl;
+        return;
+    }
+    profileCsv << "step,phase,threads,wall_ms,mean_busy_ms,max_busy_ms,imbalance,idle_fraction,"
+                  "particles,pairs,max_thread_pairs\n";
+}
+
+void CountPairs(uint32_t count)
+{
+    if (options.profile)
+    {
+        profiledPairs += count;
+    }
+}
+
+template<typename Func>
+void ProfileThread(Phase phase, uint32_t t, uint64_t particles, Func&& func)
+{
+    // runs func on thread t and, when profiling, adds its busy time, particles and pairs to the
+    // entry of the thread in the current step of phase
+    if (!options.profile)
+    {
+        func();
+        return;
+    }
+
+    auto start     = std::chrono::steady_clock::now();
+    uint64_t pairs = profiledPairs;
+    func();
+    std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+    ThreadProfile& profile             = phaseProfiles[(int)phase].step[t];
+    profile.busy += busy.count();
+    profile.particles += particles;
+    profile.pairs += profiledPairs - pairs;
+}
+
+void FinishPhaseProfiles()
+{
+    // one sample per phase and step. Imbalance is the slowest thread over the mean, 1 when every
+    // thread was busy equally long. Idle time is what the threads spent outside their work, in the
+    // handoff, in serial parts of the phase or waiting for the slowest one
+    for (int phase = 0; phase < (int)Phase::Count; ++phase)
+    {
+        PhaseProfile& profile     = phaseProfiles[phase];
+        const uint32_t numThreads = profile.stepThreads;
+        if (numThreads == 0)
+        {
+            continue;
+        }
+
+        double sumBusy         = 0.0, maxBusy = 0.0;
+        uint64_t particleCount = 0, pairCount = 0, maxPairs = 0;
+        profile.threads.resize(std::max((uint32_t)profile.threads.size(), numThreads));
+        for (uint32_t t = 0; t < numThreads; ++t)
+        {
+            const ThreadProfile& thread = profile.step[t];
+            sumBusy += thread.busy;
+            maxBusy = std::max(maxBusy, thread.busy);
+            particleCount += thread.particles;
+            pairCount += thread.pairs;
+            maxPairs = std::max(maxPairs, thread.pairs);
+
+            profile.threads[t].busy += thread.busy;
+            profile.threads[t].particles += thread.particles;
+            profile.threads[t].pairs += thread.pairs;
+        }
+        const double wall = profile.stepWall;
+        double meanBusy   = sumBusy / numThreads;
+        double imbalance  = meanBusy > 0.0 ? maxBusy / meanBusy : 1.0;
+        double threadTime = wall * numThreads;
+        double idle       = std::max(threadTime - sumBusy, 0.0);
+
+        ++profile.calls;
+        profile.wall += wall;
+        profile.imbalanceSum += imbalance;
+        profile.imbalanceMax = std::max(profile.imbalanceMax, imbalance);
+        profile.idleSum += idle;
+        profile.threadTimeSum += threadTime;
+
+        if (profileCsv.is_open())
+        {
+            profileCsv << stepCount << "," << PHASE_NAMES[phase] << "," << numThreads << ","
+                       << wall * 1e3 << "," << meanBusy * 1e3 << "," << maxBusy * 1e3 << ","
+                       << imbalance << "," << (threadTime > 0.0 ? idle / threadTime : 0.0) << ","
+                       << particleCount << "," << pairCount << "," << maxPairs << "\n";
+        }
+
+        std::fill(profile.step.begin(), profile.step.end(), ThreadProfile());
+        profile.stepWall    = 0.0;
+        profile.stepThreads = 0;
+    }
+}
+
+void PrintProfile()
+{
+    for (int phase = 0; phase < (int)Phase::Count; ++phase)
+    {
+        const PhaseProfile& profile = phaseProfiles[phase];
+        if (profile.calls == 0)
+        {
+            continue;
+        }
+
+        std::cout << "profile " << PHASE_NAMES[phase] << ": " << profile.calls << " steps, "
+                  << profile.wall * 1e3 / profile.calls << " ms per step, imbalance "
+                  << profile.imbalanceSum / profile.calls << " mean / " << profile.imbalanceMax
+                  << " max, idle " << 100.0 * profile.idleSum / profile.threadTimeSum << "%"
+                  << std::endl;
+        for (uint32_t t = 0; t < profile.threads.size(); ++t)
+        {
+            const ThreadProfile& thread = profile.threads[t];
+            std::cout << "  thread " << t << ": busy " << thread.busy * 1e3 << " ms, "
+                      << thread.particles << " particles, " << thread.pairs << " pairs"
+                      << std::endl;
+        }
+    }
+}
+
+template<typename T>
+bool ParseValue(std::string_view text, T& value)
+{
+    // the whole text has to be the number, value is left alone otherwise. libc++ before 20 has
+    // no floating point from_chars, so floats go through strtof
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        const std::string copy(text);
+        char* end = nullptr;
+        errno     = 0;
+        T parsed  = std::strtof(copy.c_str(), &end);
+        if (copy.empty() || errno != 0 || end != copy.c_str() + copy.size())
+        {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+    else
+    {
+        T parsed;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), parsed);
+        if (error != std::errc() || end != text.data() + text.size())
+        {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+}
+
+void ParseOptions(int argc, char* argv[])
+{
+    // NUMA settings can also come from the environment, for job scripts that only set variables
+    auto envFlag = [](const char* name)
+    {
+        const char* value = std::getenv(name);
+        return value && std::string_view(value) != "0";
+    };
+    options.pinThreads = envFlag("SPH_PIN_THREADS");
+    options.firstTouch = envFlag("SPH_FIRST_TOUCH");
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        bool valid           = true;
+        if (arg.starts_with("--reorder="))
+        {
+            valid = ParseValue(arg.substr(10), options.reorderInterval);
+        }
+        else if (arg == "--grid=dense")
+        {
+            options.grid = GridType::Dense;
+        }
+        else if (arg == "--grid=hash")
+        {
+            options.grid = GridType::Hash;
+        }
+        else if (arg.starts_with("--cell-divisions="))
+        {
+            uint32_t divisions    = options.cellDivisions;
+            valid                 = ParseValue(arg.substr(17), divisions);
+            options.cellDivisions = std::clamp(divisions, 1u, 4u);
+        }
+        else if (arg == "--symmetric")
+        {
+            options.symmetric = true;
+        }
+        else if (arg == "--pair-cache")
+        {
+            options.pairCache = true;
+        }
+        else if (arg.starts_with("--verlet-skin="))
+        {
+            valid = ParseValue(arg.substr(14), options.verletSkin);
+        }
+        else if (arg.starts_with("--adaptive-h="))
+        {
+            valid = ParseValue(arg.substr(13), options.adaptiveNeighbors);
+        }
+        else if (arg == "--schedule=static")
+        {
+            options.schedule = Schedule::Static;
+        }
+        else if (arg == "--schedule=dynamic")
+        {
+            options.schedule = Schedule::Dynamic;
+        }
+        else if (arg == "--pin-threads")
+        {
+            options.pinThreads = true;
+        }
+        else if (arg == "--first-touch")
+        {
+            options.firstTouch = true;
+        }
+        else if (arg.starts_with("--threads="))
+        {
+            std::string_view value = arg.substr(10);
+            if (value == "auto")
+            {
+                options.threads = 0;
+            }
+            else
+            {
+                valid = ParseValue(value, options.threads);
+            }
+        }
+        else if (arg == "--cell-order")
+        {
+            options.cellOrder = true;
+        }
+        else if (arg == "--simd")
+        {
+            options.simd = true;
+        }
+        else if (arg.starts_with("--clusters="))
+        {
+            uint32_t size       = options.clusterSize;
+            valid               = ParseValue(arg.substr(11), size);
+            options.clusterSize = std::min(size, MAX_CLUSTER_SIZE);
+        }
+        else if (arg == "--profile")
+        {
+            options.profile = true;
+        }
+        else if (arg.starts_with("--profile-csv="))
+        {
+            options.profile    = true;
+            options.profileCsv = std::string(arg.substr(14));
+        }
+        else if (arg == "--async-render")
+        {
+            options.asyncRender = true;
+        }
+        else if (arg == "--fused")
+        {
+            options.fused = true;
+        }
+        else if (arg.starts_with("--grain="))
+        {
+            uint32_t grain = options.grain;
+            valid          = ParseValue(arg.substr(8), grain);
+            options.grain  = std::max(grain, 1u);
+        }
+        else
+        {
+            std::cout << "unknown option: " << arg << std::endl;
+        }
+
+        if (!valid)
+        {
+            std::cout << "invalid option value: " << arg << std::endl;
+        }
+    }
+
+    if (options.adaptiveNeighbors > 0)
+    {
+        // the multi-level grid is a hashed grid and the adaptive passes search it directly
+        if (options.verletSkin > 0.0f || options.symmetric || options.pairCache)
+        {
+            std::cout << "--adaptive-h ignores --verlet-skin, --symmetric and --pair-cache"
+                      << std::endl;
+        }
+        options.grid       = GridType::Hash;
+        options.verletSkin = 0.0f;
+        options.symmetric  = false;
+        options.pairCache  = false;
+    }
+
+    if (options.fused && (options.verletSkin > 0.0f || options.symmetric
+                          || options.adaptiveNeighbors > 0))
+    {
+        // those modes have serial or differently shaped phases between their parallel loops
+        std::cout << "--fused only runs the plain passes, ignored with --verlet-skin, --symmetric "
+                     "and --adaptive-h"
+                  << std::endl;
+        options.fused = false;
+    }
+
+    if (options.cellOrder
+        && (options.verletSkin > 0.0f || options.symmetric || options.adaptiveNeighbors > 0
+            || options.fused))
+    {
+        // the symmetric pass already walks the grid in cell order through its half stencil
+        std::cout << "--cell-order only applies to the plain passes, ignored with --verlet-skin, "
+                     "--symmetric, --adaptive-h and --fused"
+                  << std::endl;
+        options.cellOrder = false;
+    }
+
+    if (options.simd
+        && (options.symmetric || options.pairCache || options.adaptiveNeighbors > 0
+            || options.cellOrder))
+    {
+        // the batch kernels stage the candidates of one particle and record no pairs
+        std::cout << "--simd only applies to the per-particle passes, ignored with --symmetric, "
+                     "--pair-cache, --adaptive-h and --cell-order"
+                  << std::endl;
+        options.simd = false;
+    }
+    if (options.clusterSize > 0
+        && (options.verletSkin > 0.0f || options.symmetric || options.pairCache
+            || options.adaptiveNeighbors > 0 || options.cellOrder || options.fused || options.simd))
+    {
+        // the cluster pairs replace the per-particle candidates those modes are built on
+        std::cout << "--clusters replaces the per-particle passes, ignored with --verlet-skin, "
+                     "--symmetric, --pair-cache, --adaptive-h, --cell-order, --fused and --simd"
+                  << std::endl;
+        options.clusterSize = 0;
+    }
+    if (options.firstTouch && options.schedule != Schedule::Static)
+    {
+        // a page only helps the thread that placed it, so every pass keeps the ThreadRange slices
+        std::cout << "--first-touch runs the static schedule" << std::endl;
+        options.schedule = Schedule::Static;
+    }
+    if (options.simd || options.clusterSize > 0)
+    {
+        std::cout << "simd = " << SIMD_ISA << ", " << RealVector::WIDTH << " lanes" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    ParseOptions(argc, argv);
+    InitSDL();
+    if (options.asyncRender)
+    {
+        // the solver thread sets up its own pool, the render loop starts once the particles exist
+        solverThread = std::thread(
+            []()
+            {
+                InitSolver();
+                solverReady = true;
+                solverReady.notify_one();
+                SolverLoop();
+            });
+        solverReady.wait(false);
+    }
+    else
+    {
+        InitSolver();
+    }
+
+    auto mainLoop = []()
+    {
+#ifdef __EMSCRIPTEN__
+        if (!isRunning)
+        {
+            emscripten_cancel_main_loop();
+            Shutdown();
+            return;
+        }
+#endif
+
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            switch (event.type)
+            {
+                case SDL_QUIT:
+                    isRunning = false;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        auto state = SDL_GetKeyboardState(NULL);
+        if (state[SDL_SCANCODE_ESCAPE])
+        {
+            isRunning = false;
+        }
+
+        if (!options.asyncRender)
+        {
+            Update();
+            PublishFrame();
+        }
         Render();
     };
 
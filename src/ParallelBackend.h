@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "ThreadPool.h"
+
+#ifdef SPH_BACKEND_OPENMP
+    #include <omp.h>
+#endif
+
+/**
+ * runtimes the solver can run its parallel phases on, picked with SPH_PARALLEL_BACKEND in CMake
+ * each one runs func(t) for every t in [0, Size()) and supports Barrier() between those calls
+ */
+
+// everything on the calling thread, a deterministic reference for the other backends
+class SerialBackend
+{
+public:
+    void Start(uint32_t numThreads, bool pin) {}
+    void Stop() {}
+
+    template<typename Func>
+    void Run(Func&& func)
+    {
+        func(0u);
+    }
+
+    void Barrier() {}
+
+    uint32_t Size() const
+    {
+        return 1;
+    }
+};
+
+#ifdef SPH_BACKEND_OPENMP
+// one OpenMP parallel region per call, pinning is left to OMP_PROC_BIND and OMP_PLACES
+class OpenMPBackend
+{
+public:
+    void Start(uint32_t numThreads, bool pin)
+    {
+        // every thread index has to show up, so the runtime may not hand out fewer threads, and
+        // the team may not ask for more than OMP_THREAD_LIMIT allows, nor for no threads at all
+        omp_set_dynamic(0);
+        size = std::clamp(numThreads, 1u, (uint32_t)omp_get_thread_limit());
+    }
+
+    void Stop() {}
+
+    template<typename Func>
+    void Run(Func&& func)
+    {
+    #pragma omp parallel num_threads(size)
+        {
+            // a smaller team, e.g. when nested, would silently skip the work of the missing indices
+            if ((uint32_t)omp_get_num_threads() != size)
+            {
+                std::fprintf(stderr,
+                             "OpenMP started %d of %u threads\n",
+                             omp_get_num_threads(),
+                             size);
+                std::abort();
+            }
+            func((uint32_t)omp_get_thread_num());
+        }
+    }
+
+    void Barrier()
+    {
+    #pragma omp barrier
+    }
+
+    uint32_t Size() const
+    {
+        return size;
+    }
+
+private:
+    uint32_t size = 1;
+};
+#endif
+
+#if defined(SPH_BACKEND_SERIAL)
+using ParallelBackend                         = SerialBackend;
+inline constexpr const char* PARALLEL_BACKEND = "serial";
+#elif defined(SPH_BACKEND_OPENMP)
+using ParallelBackend                         = OpenMPBackend;
+inline constexpr const char* PARALLEL_BACKEND = "openmp";
+#else
+using ParallelBackend                         = ThreadPool;
+inline constexpr const char* PARALLEL_BACKEND = "pool";
+#endif
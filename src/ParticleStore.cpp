@@ -0,0 +1,52 @@
+#include "ParticleStore.h"
+
+void ParticleStore::Add(Real px, Real py, Real smoothingLength, uint32_t particleId)
+{
+    x.push_back(px);
+    y.push_back(py);
+    vx.push_back(0);
+    vy.push_back(0);
+    fx.push_back(0);
+    fy.push_back(0);
+    density.push_back(0);
+    pressure.push_back(0);
+    h.push_back(smoothingLength);
+    id.push_back(particleId);
+}
+
+void ParticleStore::Gather(const ParticleStore& source, const uint32_t* order)
+{
+    // one array at a time, so each pass reads and writes only two streams
+    auto gather = [order, count = source.Size()](auto& to, const auto& from)
+    {
+        to.resize(count);
+        for (uint32_t k = 0; k < count; ++k)
+        {
+            to[k] = from[order[k]];
+        }
+    };
+    gather(x, source.x);
+    gather(y, source.y);
+    gather(vx, source.vx);
+    gather(vy, source.vy);
+    gather(fx, source.fx);
+    gather(fy, source.fy);
+    gather(density, source.density);
+    gather(pressure, source.pressure);
+    gather(h, source.h);
+    gather(id, source.id);
+}
+
+void ParticleStore::Swap(ParticleStore& other)
+{
+    x.swap(other.x);
+    y.swap(other.y);
+    vx.swap(other.vx);
+    vy.swap(other.vy);
+    fx.swap(other.fx);
+    fy.swap(other.fy);
+    density.swap(other.density);
+    pressure.swap(other.pressure);
+    h.swap(other.h);
+    id.swap(other.id);
+}
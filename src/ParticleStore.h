@@ -0,0 +1,116 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include "Precision.h"
+
+// while set, fresh storage of count elements of size bytes is handed to it before allocate returns,
+// so the threads that will work on each part of it can touch its pages first
+inline void (*firstTouchPages)(void* storage, std::size_t count, std::size_t size) = nullptr;
+
+// allocator for particle and grid arrays, every array starts on a cache line so SIMD loads stay
+// aligned
+template<typename T>
+struct AlignedAllocator
+{
+    using value_type                       = T;
+    static constexpr std::size_t ALIGNMENT = 64;
+
+    AlignedAllocator() = default;
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U>&)
+    {
+    }
+
+    T* allocate(std::size_t count)
+    {
+        T* pointer =
+            static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(ALIGNMENT)));
+        if (firstTouchPages)
+        {
+            firstTouchPages(pointer, count, sizeof(T));
+        }
+        return pointer;
+    }
+
+    void deallocate(T* pointer, std::size_t)
+    {
+        ::operator delete(pointer, std::align_val_t(ALIGNMENT));
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U>&) const
+    {
+        return true;
+    }
+};
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+/**
+ * particle data as a structure of arrays
+ * each quantity lives in its own contiguous array, so a pass only streams the arrays it reads
+ * Position() and Velocity() assemble a Vector2r for code that works per particle
+ */
+struct ParticleStore
+{
+    AlignedVector<Real> x, y;    // position
+    AlignedVector<Real> vx, vy;  // velocity
+    AlignedVector<Real> fx, fy;  // force
+    AlignedVector<Real> density;
+    AlignedVector<Real> pressure;
+    AlignedVector<Real> h;       // smoothing length, stays H unless adaptive h is enabled
+    AlignedVector<uint32_t> id;  // stable identity, survives reordering
+
+    uint32_t Size() const
+    {
+        return (uint32_t)x.size();
+    }
+
+    // calls func on every array, for code that treats them all alike
+    template<typename Func>
+    void ForEachArray(Func&& func)
+    {
+        func(x);
+        func(y);
+        func(vx);
+        func(vy);
+        func(fx);
+        func(fy);
+        func(density);
+        func(pressure);
+        func(h);
+        func(id);
+    }
+
+    void Add(Real px, Real py, Real smoothingLength, uint32_t particleId);
+
+    // this = source reordered so that particle k is source particle order[k]
+    void Gather(const ParticleStore& source, const uint32_t* order);
+    void Swap(ParticleStore& other);
+
+    Vector2r Position(uint32_t i) const
+    {
+        return {x[i], y[i]};
+    }
+
+    Vector2r Velocity(uint32_t i) const
+    {
+        return {vx[i], vy[i]};
+    }
+};
+
+// Eigen view of the particles [begin, end) of one array, for array expressions over a range
+template<typename T>
+Eigen::Map<Eigen::Array<T, Eigen::Dynamic, 1>> ArrayView(AlignedVector<T>& values,
+                                                          uint32_t begin,
+                                                          uint32_t end)
+{
+    return {values.data() + begin, (Eigen::Index)(end - begin)};
+}
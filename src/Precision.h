@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+/**
+ * floating point types of the solver, picked with SPH_PRECISION in CMake
+ * Real is what particles are stored in and what kernels and grid math are evaluated in,
+ * Accum is what the density and force sums of a particle are accumulated in
+ */
+#if defined(SPH_PRECISION_FLOAT)
+using Real                             = float;
+using Accum                            = float;
+inline constexpr const char* PRECISION = "float";
+#elif defined(SPH_PRECISION_MIXED)
+// half the bandwidth and twice the SIMD lanes of double, without summing hundreds of terms in float
+using Real                             = float;
+using Accum                            = double;
+inline constexpr const char* PRECISION = "mixed";
+#else
+using Real                             = double;
+using Accum                            = double;
+inline constexpr const char* PRECISION = "double";
+#endif
+
+using Vector2r = Eigen::Matrix<Real, 2, 1>;
+using Vector2a = Eigen::Matrix<Accum, 2, 1>;
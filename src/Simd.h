@@ -0,0 +1,653 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+/**
+ * fixed width vectors of float or double for the batch kernels
+ * the widest instruction set the compiler targets is used, AVX-512, AVX/AVX2 or SSE2 on x86 and
+ * NEON on 64-bit ARM, so the width follows SPH_SIMD in CMake or -march
+ * Load() and Store() expect pointers aligned to the vector, masks only feed Blend()
+ * Widen() converts the float lanes to double, the low half and the high half of them
+ */
+
+// one lane, for types and targets without a vector specialization
+template<typename T>
+struct SimdVector
+{
+    static constexpr uint32_t WIDTH = 1;
+    using Mask                      = bool;
+
+    T value;
+
+    static SimdVector Load(const T* pointer)
+    {
+        return {*pointer};
+    }
+
+    static SimdVector Broadcast(T scalar)
+    {
+        return {scalar};
+    }
+
+    void Store(T* pointer) const
+    {
+        *pointer = value;
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {a.value + b.value};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {a.value - b.value};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {a.value * b.value};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {a.value / b.value};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return a.value < b.value;
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {std::sqrt(a.value)};
+    }
+
+    // a where mask is set, b elsewhere
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return mask ? a : b;
+    }
+};
+
+#if defined(__AVX512F__)
+inline constexpr const char* SIMD_ISA = "avx512";
+
+template<>
+struct SimdVector<float>
+{
+    static constexpr uint32_t WIDTH = 16;
+    using Mask                      = __mmask16;
+
+    __m512 value;
+
+    static SimdVector Load(const float* pointer)
+    {
+        return {_mm512_load_ps(pointer)};
+    }
+
+    static SimdVector Broadcast(float scalar)
+    {
+        return {_mm512_set1_ps(scalar)};
+    }
+
+    void Store(float* pointer) const
+    {
+        _mm512_store_ps(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {_mm512_add_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {_mm512_sub_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {_mm512_mul_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {_mm512_div_ps(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return _mm512_cmp_ps_mask(a.value, b.value, _CMP_LT_OQ);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {_mm512_sqrt_ps(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {_mm512_mask_blend_ps(mask, b.value, a.value)};
+    }
+};
+
+template<>
+struct SimdVector<double>
+{
+    static constexpr uint32_t WIDTH = 8;
+    using Mask                      = __mmask8;
+
+    __m512d value;
+
+    static SimdVector Load(const double* pointer)
+    {
+        return {_mm512_load_pd(pointer)};
+    }
+
+    static SimdVector Broadcast(double scalar)
+    {
+        return {_mm512_set1_pd(scalar)};
+    }
+
+    void Store(double* pointer) const
+    {
+        _mm512_store_pd(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {_mm512_add_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {_mm512_sub_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {_mm512_mul_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {_mm512_div_pd(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return _mm512_cmp_pd_mask(a.value, b.value, _CMP_LT_OQ);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {_mm512_sqrt_pd(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {_mm512_mask_blend_pd(mask, b.value, a.value)};
+    }
+};
+
+inline std::pair<SimdVector<double>, SimdVector<double>> Widen(SimdVector<float> a)
+{
+    __m256 high = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a.value), 1));
+    return {{_mm512_cvtps_pd(_mm512_castps512_ps256(a.value))}, {_mm512_cvtps_pd(high)}};
+}
+
+#elif defined(__AVX__)
+    #if defined(__AVX2__)
+inline constexpr const char* SIMD_ISA = "avx2";
+    #else
+inline constexpr const char* SIMD_ISA = "avx";
+    #endif
+
+// the kernels only need float arithmetic, which AVX already has at full width
+template<>
+struct SimdVector<float>
+{
+    static constexpr uint32_t WIDTH = 8;
+    using Mask                      = __m256;
+
+    __m256 value;
+
+    static SimdVector Load(const float* pointer)
+    {
+        return {_mm256_load_ps(pointer)};
+    }
+
+    static SimdVector Broadcast(float scalar)
+    {
+        return {_mm256_set1_ps(scalar)};
+    }
+
+    void Store(float* pointer) const
+    {
+        _mm256_store_ps(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {_mm256_add_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {_mm256_sub_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {_mm256_mul_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {_mm256_div_ps(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return _mm256_cmp_ps(a.value, b.value, _CMP_LT_OQ);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {_mm256_sqrt_ps(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {_mm256_blendv_ps(b.value, a.value, mask)};
+    }
+};
+
+template<>
+struct SimdVector<double>
+{
+    static constexpr uint32_t WIDTH = 4;
+    using Mask                      = __m256d;
+
+    __m256d value;
+
+    static SimdVector Load(const double* pointer)
+    {
+        return {_mm256_load_pd(pointer)};
+    }
+
+    static SimdVector Broadcast(double scalar)
+    {
+        return {_mm256_set1_pd(scalar)};
+    }
+
+    void Store(double* pointer) const
+    {
+        _mm256_store_pd(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {_mm256_add_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {_mm256_sub_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {_mm256_mul_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {_mm256_div_pd(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return _mm256_cmp_pd(a.value, b.value, _CMP_LT_OQ);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {_mm256_sqrt_pd(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {_mm256_blendv_pd(b.value, a.value, mask)};
+    }
+};
+
+inline std::pair<SimdVector<double>, SimdVector<double>> Widen(SimdVector<float> a)
+{
+    return {{_mm256_cvtps_pd(_mm256_castps256_ps128(a.value))},
+            {_mm256_cvtps_pd(_mm256_extractf128_ps(a.value, 1))}};
+}
+
+#elif defined(__SSE2__) || defined(_M_X64)
+inline constexpr const char* SIMD_ISA = "sse2";
+
+// SSE2 has no blend instruction, Blend() masks both sides with the all-ones or all-zeros lanes
+template<>
+struct SimdVector<float>
+{
+    static constexpr uint32_t WIDTH = 4;
+    using Mask                      = __m128;
+
+    __m128 value;
+
+    static SimdVector Load(const float* pointer)
+    {
+        return {_mm_load_ps(pointer)};
+    }
+
+    static SimdVector Broadcast(float scalar)
+    {
+        return {_mm_set1_ps(scalar)};
+    }
+
+    void Store(float* pointer) const
+    {
+        _mm_store_ps(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {_mm_add_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {_mm_sub_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {_mm_mul_ps(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {_mm_div_ps(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return _mm_cmplt_ps(a.value, b.value);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {_mm_sqrt_ps(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {_mm_or_ps(_mm_and_ps(mask, a.value), _mm_andnot_ps(mask, b.value))};
+    }
+};
+
+template<>
+struct SimdVector<double>
+{
+    static constexpr uint32_t WIDTH = 2;
+    using Mask                      = __m128d;
+
+    __m128d value;
+
+    static SimdVector Load(const double* pointer)
+    {
+        return {_mm_load_pd(pointer)};
+    }
+
+    static SimdVector Broadcast(double scalar)
+    {
+        return {_mm_set1_pd(scalar)};
+    }
+
+    void Store(double* pointer) const
+    {
+        _mm_store_pd(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {_mm_add_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {_mm_sub_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {_mm_mul_pd(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {_mm_div_pd(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return _mm_cmplt_pd(a.value, b.value);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {_mm_sqrt_pd(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {_mm_or_pd(_mm_and_pd(mask, a.value), _mm_andnot_pd(mask, b.value))};
+    }
+};
+
+inline std::pair<SimdVector<double>, SimdVector<double>> Widen(SimdVector<float> a)
+{
+    return {{_mm_cvtps_pd(a.value)}, {_mm_cvtps_pd(_mm_movehl_ps(a.value, a.value))}};
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+inline constexpr const char* SIMD_ISA = "neon";
+
+template<>
+struct SimdVector<float>
+{
+    static constexpr uint32_t WIDTH = 4;
+    using Mask                      = uint32x4_t;
+
+    float32x4_t value;
+
+    static SimdVector Load(const float* pointer)
+    {
+        return {vld1q_f32(pointer)};
+    }
+
+    static SimdVector Broadcast(float scalar)
+    {
+        return {vdupq_n_f32(scalar)};
+    }
+
+    void Store(float* pointer) const
+    {
+        vst1q_f32(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {vaddq_f32(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {vsubq_f32(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {vmulq_f32(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {vdivq_f32(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return vcltq_f32(a.value, b.value);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {vsqrtq_f32(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {vbslq_f32(mask, a.value, b.value)};
+    }
+};
+
+template<>
+struct SimdVector<double>
+{
+    static constexpr uint32_t WIDTH = 2;
+    using Mask                      = uint64x2_t;
+
+    float64x2_t value;
+
+    static SimdVector Load(const double* pointer)
+    {
+        return {vld1q_f64(pointer)};
+    }
+
+    static SimdVector Broadcast(double scalar)
+    {
+        return {vdupq_n_f64(scalar)};
+    }
+
+    void Store(double* pointer) const
+    {
+        vst1q_f64(pointer, value);
+    }
+
+    friend SimdVector operator+(SimdVector a, SimdVector b)
+    {
+        return {vaddq_f64(a.value, b.value)};
+    }
+
+    friend SimdVector operator-(SimdVector a, SimdVector b)
+    {
+        return {vsubq_f64(a.value, b.value)};
+    }
+
+    friend SimdVector operator*(SimdVector a, SimdVector b)
+    {
+        return {vmulq_f64(a.value, b.value)};
+    }
+
+    friend SimdVector operator/(SimdVector a, SimdVector b)
+    {
+        return {vdivq_f64(a.value, b.value)};
+    }
+
+    friend Mask operator<(SimdVector a, SimdVector b)
+    {
+        return vcltq_f64(a.value, b.value);
+    }
+
+    friend SimdVector Sqrt(SimdVector a)
+    {
+        return {vsqrtq_f64(a.value)};
+    }
+
+    friend SimdVector Blend(Mask mask, SimdVector a, SimdVector b)
+    {
+        return {vbslq_f64(mask, a.value, b.value)};
+    }
+};
+
+inline std::pair<SimdVector<double>, SimdVector<double>> Widen(SimdVector<float> a)
+{
+    return {{vcvt_f64_f32(vget_low_f32(a.value))}, {vcvt_high_f64_f32(a.value)}};
+}
+
+#else
+inline constexpr const char* SIMD_ISA = "scalar";
+
+// one lane has no high half
+inline std::pair<SimdVector<double>, SimdVector<double>> Widen(SimdVector<float> a)
+{
+    return {{a.value}, {0.0}};
+}
+#endif
+
+// sum of the lanes, added up in Sum so that mixed precision keeps its wide accumulation
+template<typename Sum, typename T>
+Sum ReduceAdd(SimdVector<T> vector)
+{
+    alignas(64) T lanes[SimdVector<T>::WIDTH];
+    vector.Store(lanes);
+    Sum sum = 0;
+    for (uint32_t k = 0; k < SimdVector<T>::WIDTH; ++k)
+    {
+        sum += lanes[k];
+    }
+    return sum;
+}
+
+// running sums of SimdVector<T> lanes kept in Sum lanes, reduced to one Sum at the end
+template<typename Sum, typename T>
+struct SimdSum
+{
+    SimdVector<T> lanes = SimdVector<T>::Broadcast(0);
+
+    void Add(SimdVector<T> value)
+    {
+        lanes = lanes + value;
+    }
+
+    Sum Reduce() const
+    {
+        return ReduceAdd<Sum>(lanes);
+    }
+};
+
+// float values summed in double, each value is widened into two double vectors
+template<>
+struct SimdSum<double, float>
+{
+    SimdVector<double> low  = SimdVector<double>::Broadcast(0.0);
+    SimdVector<double> high = SimdVector<double>::Broadcast(0.0);
+
+    void Add(SimdVector<float> value)
+    {
+        auto [lowValue, highValue] = Widen(value);
+        low                        = low + lowValue;
+        high                       = high + highValue;
+    }
+
+    double Reduce() const
+    {
+        return ReduceAdd<double>(low + high);
+    }
+};
@@ -0,0 +1,156 @@
+#include "ThreadPool.h"
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+// iterations a thread polls before it blocks, long enough to bridge the gap between two phases
+static constexpr int SPIN_COUNT = 4096;
+
+ThreadPool::~ThreadPool()
+{
+    Stop();
+}
+
+void ThreadPool::Start(uint32_t numThreads, bool pin)
+{
+    Stop();
+    stopping = false;
+
+    cpus.clear();
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+    // collect the allowed cpus before pinning the caller, so taskset and cgroup limits still apply
+    cpu_set_t allowed;
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    PinThread(0);
+
+    // workers start from the current generation so a restarted pool does not replay the stop job
+    uint32_t seen = generation.load(std::memory_order_relaxed);
+    for (uint32_t t = 1; t < numThreads; ++t)
+    {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this, t, seen);
+    }
+}
+
+void ThreadPool::Stop()
+{
+    if (workers.empty())
+    {
+        return;
+    }
+
+    stopping = true;
+    Dispatch(nullptr, nullptr);
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    workers.clear();
+}
+
+void ThreadPool::Dispatch(Job newJob, void* newContext)
+{
+    job     = newJob;
+    context = newContext;
+    pending.store((uint32_t)workers.size(), std::memory_order_relaxed);
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+
+    if (job)
+    {
+        job(context, 0);
+    }
+
+    for (int spin = 0; pending.load(std::memory_order_acquire) != 0; ++spin)
+    {
+        if (spin >= SPIN_COUNT)
+        {
+            uint32_t remaining = pending.load(std::memory_order_acquire);
+            if (remaining != 0)
+            {
+                pending.wait(remaining, std::memory_order_acquire);
+            }
+        }
+    }
+}
+
+void ThreadPool::Barrier()
+{
+    // the phase cannot move on before this thread arrives, so reading it first is safe
+    uint32_t phase = barrierPhase.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == Size())
+    {
+        arrived.store(0, std::memory_order_relaxed);
+        barrierPhase.fetch_add(1, std::memory_order_release);
+        barrierPhase.notify_all();
+        return;
+    }
+
+    for (int spin = 0; barrierPhase.load(std::memory_order_acquire) == phase; ++spin)
+    {
+        if (spin >= SPIN_COUNT)
+        {
+            barrierPhase.wait(phase, std::memory_order_acquire);
+        }
+    }
+}
+
+void ThreadPool::PinThread(uint32_t t)
+{
+    if (cpus.empty())
+    {
+        return;
+    }
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+    // a failed pin only costs locality, so the thread keeps running unpinned
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[t % cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+void ThreadPool::WorkerLoop(uint32_t t, uint32_t seen)
+{
+    PinThread(t);
+    while (true)
+    {
+        uint32_t current = generation.load(std::memory_order_acquire);
+        for (int spin = 0; current == seen; ++spin)
+        {
+            if (spin >= SPIN_COUNT)
+            {
+                generation.wait(seen, std::memory_order_acquire);
+            }
+            current = generation.load(std::memory_order_acquire);
+        }
+        seen = current;
+
+        bool stop = stopping;
+        if (!stop)
+        {
+            job(context, t);
+        }
+
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            pending.notify_one();
+        }
+        if (stop)
+        {
+            return;
+        }
+    }
+}
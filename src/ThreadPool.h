@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * persistent worker threads for the parallel phases of the solver
+ * the calling thread takes part as worker 0, so Start() spawns numThreads - 1 workers
+ * workers spin for a short while after each job and then block until the next one
+ * with pinning, thread t is bound to the t-th cpu the process may run on (Linux only)
+ */
+class ThreadPool
+{
+public:
+    ThreadPool()                             = default;
+    ThreadPool(const ThreadPool&)            = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    void Start(uint32_t numThreads, bool pin = false);
+    void Stop();
+
+    // runs func(t) for every t in [0, Size()) and returns when all of them are done
+    template<typename Func>
+    void Run(Func&& func)
+    {
+        using Callable = std::remove_reference_t<Func>;
+        Dispatch([](void* context, uint32_t t) { (*static_cast<Callable*>(context))(t); },
+                 (void*)&func);
+    }
+
+    // called by every thread inside Run(), returns once all of them have reached it
+    void Barrier();
+
+    uint32_t Size() const
+    {
+        return (uint32_t)workers.size() + 1;
+    }
+
+private:
+    using Job = void (*)(void* context, uint32_t t);
+
+    void Dispatch(Job job, void* context);
+    void WorkerLoop(uint32_t t, uint32_t seen);
+    void PinThread(uint32_t t);
+
+    std::vector<std::thread> workers;
+    Job job       = nullptr;
+    void* context = nullptr;
+    bool stopping = false;
+    std::vector<int> cpus;  // cpus to pin threads to, empty when not pinning
+
+    std::atomic<uint32_t> generation {0};    // bumped once per job, workers wait for a change
+    std::atomic<uint32_t> pending {0};       // workers still running the current job
+    std::atomic<uint32_t> arrived {0};       // threads waiting at the current barrier
+    std::atomic<uint32_t> barrierPhase {0};  // bumped when the last thread arrives
+};